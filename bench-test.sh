@@ -0,0 +1,21 @@
+#!/bin/bash
+# Run the aesdsocket micro-benchmarks and compare them against the stored
+# baseline in server/bench/baseline.json, fails on regressions.
+# Results are compared relative to CPU and syscall calibration runs on the
+# same machine, so the baseline carries over between similar machines.
+# Pass -u to record the current results as new baseline instead of
+# comparing, e.g. after moving to a different kind of CPU or after an
+# intended slowdown.
+# Results are written to build-bench/bench-results.json
+set -e
+
+cd `dirname $0`
+mkdir -p build-bench
+cmake -S server/bench -B build-bench
+cmake --build build-bench
+
+if [ "$1" == "-u" ]; then
+    cmake --build build-bench --target bench-baseline
+else
+    ctest --test-dir build-bench -L bench --output-on-failure
+fi
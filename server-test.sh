@@ -0,0 +1,18 @@
+#!/bin/bash
+# Build the socket server and run its behaviour tests in server/test.
+# Pass test names to run only those, e.g. ./server-test.sh replication
+cd `dirname $0`
+make -C server || exit 1
+
+tests=${@:-$(ls server/test/test-*.sh | sed 's|.*/test-\(.*\)\.sh|\1|')}
+failed=0
+
+for test in ${tests}; do
+    echo "Running ${test} test"
+    if ! bash server/test/test-${test}.sh; then
+        failed=$((failed + 1))
+    fi
+done
+
+echo "${failed} test(s) failed"
+exit ${failed}
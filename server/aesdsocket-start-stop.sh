@@ -2,7 +2,16 @@
 
 SERVICE_NAME=aesdsocket
 SERVICE_PATH=/usr/bin/aesdsocket
-SERVICE_ARGS=-d
+HANDOFF_PATH=/var/run/aesdsocket.sock
+HOT_RESTART=no
+
+# set HOT_RESTART=yes here to allow upgrades without dropping connections
+[ -r /etc/default/aesdsocket ] && . /etc/default/aesdsocket
+
+SERVICE_ARGS="-d"
+if [ "${HOT_RESTART}" = "yes" ]; then
+    SERVICE_ARGS="${SERVICE_ARGS} -u ${HANDOFF_PATH}"
+fi
 
 
 case "$1" in
@@ -16,8 +25,20 @@ case "$1" in
         # defaults to SIGTERM
         start-stop-daemon -K -n ${SERVICE_NAME}
         ;;
+
+    upgrade)
+        if [ "${HOT_RESTART}" != "yes" ]; then
+            echo "Hot restart is disabled, set HOT_RESTART=yes in /etc/default/aesdsocket"
+            exit 1
+        fi
+
+        echo "Upgrading aesdocket daemon"
+        # the new instance takes over from the running one and drains it,
+        # start-stop-daemon would refuse to start while it is still running
+        "${SERVICE_PATH}" ${SERVICE_ARGS}
+        ;;
     *)
-        echo "Usage: $0 start|stop"
+        echo "Usage: $0 start|stop|upgrade"
         exit 1
         ;;
 esac
@@ -5,6 +5,7 @@
 #include <arpa/inet.h>
 #include <fcntl.h>
 #include <netdb.h>
+#include <poll.h>
 #include <pthread.h>
 #include <signal.h>
 #include <stdbool.h>
@@ -13,10 +14,18 @@
 #include <string.h>
 #include <sys/socket.h>
 #include <sys/types.h>
-#include <syslog.h>
 #include <unistd.h>
 
+#include "aesdsocket_asynclog.h"
+#include "aesdsocket_coldstore.h"
 #include "aesdsocket_connectionhandler.h"
+#include "aesdsocket_datalog.h"
+#include "aesdsocket_fairshare.h"
+#include "aesdsocket_handoff.h"
+#include "aesdsocket_net.h"
+#include "aesdsocket_persist.h"
+#include "aesdsocket_replication.h"
+#include "aesdsocket_shardstore.h"
 #include "aesdsocket_threadlist.h"
 #include "aesdsocket_timer.h"
 
@@ -25,6 +34,7 @@
  **/
 static const char *syslog_ident = "aesdsocket";
 const char *default_port = "9000";
+const char *default_replication_port = "9001";
 const char *tmpfilename = "/var/tmp/aesdsocketdata";
 
 
@@ -34,90 +44,22 @@ const char *tmpfilename = "/var/tmp/aesdsocketdata";
 volatile bool _doexit = false; /* controls the server loop */
 
 
-/*
- * Get the ip address from a sockaddr struct as string.
- * Allocate output parameter `str` accordingly.
- **/
-char *get_addr_str(struct sockaddr *sa) {
-    char *str;
-
-    switch(sa->sa_family) {
-        case AF_INET: { /* ipv4 */
-            struct in_addr ina = ((struct sockaddr_in*)sa)->sin_addr;
-            str = calloc(sizeof(char), INET_ADDRSTRLEN);
-            inet_ntop(AF_INET, &ina, str, INET_ADDRSTRLEN);
-            break; }
-        case AF_INET6: {/* ipv6 */
-            struct in6_addr in6a = ((struct sockaddr_in6*)sa)->sin6_addr;
-            str = calloc(sizeof(char), INET6_ADDRSTRLEN);
-            inet_ntop(AF_INET6, &in6a, str, INET6_ADDRSTRLEN);
-            break; }
-        default: /* should not happen */
-            return "";
-    }
-
-    return str;
-}
-
-
-/*
- * Create a socket that binds to the specified port.
- */
-int bind_to_port(const char* port) {
-    int result, sock;
-    struct addrinfo hints = {0}, *sockinfo = NULL, *si;
-
-    hints.ai_family = AF_UNSPEC;
-    hints.ai_socktype = SOCK_STREAM;
-    hints.ai_flags = AI_PASSIVE;
-
-    result = getaddrinfo(NULL, port, &hints, &sockinfo);
-
-    if (result != 0) {
-        syslog(LOG_PERROR, "getaddrinfo: %s\n", gai_strerror(result));
-        return -1;
-    }
-
-    for (si = sockinfo; si != NULL; si = si->ai_next) {
-        sock = socket(si->ai_family, si->ai_socktype, si->ai_protocol);
-
-        if (sock == -1)
-            continue;
-
-        const int enable = 1; /* boolean integer flag */
-        setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &enable, sizeof(enable));
-        setsockopt(sock, SOL_SOCKET, SO_REUSEPORT, &enable, sizeof(enable));
-
-        if (bind(sock, si->ai_addr, si->ai_addrlen) == 0)
-            break;
-
-        close(sock);
-    }
-
-    if (si == NULL) {
-        syslog(LOG_PERROR, "Error binding to port %s!\n", port);
-        sock = -1;
-    }
-    else {
-        char *sockaddr = get_addr_str(si->ai_addr);
-        syslog(LOG_INFO, "Socket bound to %s\n", sockaddr);
-        free(sockaddr);
-    }
-
-    freeaddrinfo(sockinfo);
-
-    return sock;
-}
-
-
 /*
  * Signal handler for SIGINT and SIGTERM, cancels server loop.
+ * SIGUSR1 and SIGUSR2 raise and lower log verbosity.
  **/
 void sighandler(int signal) {
     switch (signal) {
         case SIGINT:
         case SIGTERM:
             _doexit = true;
+            break;
+        case SIGUSR1:
+            asynclog_adjust_level(1);
+            break;
+        case SIGUSR2:
+            asynclog_adjust_level(-1);
+            break;
         default:
             ;
     }
@@ -132,6 +74,12 @@ void setup_signal_handler() {
     sa.sa_handler = &sighandler;
     sigaction(SIGINT, &sa, NULL);
     sigaction(SIGTERM, &sa, NULL);
+    sigaction(SIGUSR1, &sa, NULL);
+    sigaction(SIGUSR2, &sa, NULL);
+
+    /* write errors on closed connections are handled where they occur */
+    sa.sa_handler = SIG_IGN;
+    sigaction(SIGPIPE, &sa, NULL);
 }
 
 
@@ -150,6 +98,30 @@ void fork_and_exit() {
 }
 
 
+/*
+ * Print commandline help
+ **/
+void usage(const char *name) {
+    fprintf(stderr,
+        "Usage: %s [-d] [-P] [-z] [-v level] [-p port] [-w datafile] [-l drop|disconnect] [-A rate] [-R rate] [-c slots] [-u path] [-s shards | -r replport | -f leader[:replport]]\n"
+        "  -d  run as daemon\n"
+        "  -P  persistent, keep the data file across restarts and recover it after crashes\n"
+        "  -z  compress cold segments of the data file, offer compressed replays\n"
+        "  -v  syslog level to log up to, 0-7, default 7, SIGUSR1/SIGUSR2 raise/lower it\n"
+        "  -p  port to listen on for clients, default %s\n"
+        "  -w  data file, default %s\n"
+        "  -l  policy for subscribers lagging behind, default drop\n"
+        "  -A  limit appends of each client address to rate bytes per second, default unlimited\n"
+        "  -R  limit replays to each client address to rate bytes per second, default unlimited\n"
+        "  -c  run at most this many appends or replay chunks at once, round-robin across clients, default one per cpu\n"
+        "  -u  hot restart, take over from the instance listening on this unix socket path\n"
+        "  -s  store data in this many datafile.N shards, 0 for one per cpu\n"
+        "  -r  act as replication leader, accepting followers on replport\n"
+        "  -f  act as read-only follower of leader, needs its own -w datafile, replport defaults to %s\n",
+        name, default_port, tmpfilename, default_replication_port);
+}
+
+
 int main(int argc, char* argv[]) {
     /* init syslog */
     openlog(syslog_ident, LOG_PERROR|LOG_PID, LOG_USER);
@@ -159,13 +131,120 @@ int main(int argc, char* argv[]) {
 
     /* parse commandline options */
     bool daemonize = false;
+    bool persistent = false;
+    bool compress = false;
+    int loglevel = LOG_DEBUG;
+    const char *port = default_port;
+    const char *replication_port = NULL;
+    const char *leader_addr = NULL;
+    const char *handoff_path = NULL;
+    bool datafile_given = false;
+    enum broadcast_policy_t laggard_policy = BROADCAST_DROP;
+    long nshards = -1;
+    size_t append_rate = 0;
+    size_t replay_rate = 0;
+    long slots = sysconf(_SC_NPROCESSORS_ONLN);
+    int opt;
+
+    while ((opt = getopt(argc, argv, "dPzv:p:w:l:A:R:c:u:s:r:f:")) != -1) {
+        switch (opt) {
+            case 'd':
+                daemonize = true;
+                break;
+            case 'P':
+                persistent = true;
+                break;
+            case 'z':
+                compress = true;
+                break;
+            case 'v':
+                loglevel = strtol(optarg, NULL, 10);
+                break;
+            case 'p':
+                port = optarg;
+                break;
+            case 'w':
+                tmpfilename = optarg;
+                datafile_given = true;
+                break;
+            case 'l':
+                if (!strcmp(optarg, "drop")) {
+                    laggard_policy = BROADCAST_DROP;
+                }
+                else if (!strcmp(optarg, "disconnect")) {
+                    laggard_policy = BROADCAST_DISCONNECT;
+                }
+                else {
+                    usage(argv[0]);
+                    exit(-1);
+                }
+                break;
+            case 'A':
+                append_rate = strtoul(optarg, NULL, 10);
+                break;
+            case 'R':
+                replay_rate = strtoul(optarg, NULL, 10);
+                break;
+            case 'c':
+                slots = strtol(optarg, NULL, 10);
+
+                if (slots < 1) {
+                    usage(argv[0]);
+                    exit(-1);
+                }
+                break;
+            case 'u':
+                handoff_path = optarg;
+                break;
+            case 's':
+                nshards = strtol(optarg, NULL, 10);
+
+                if (nshards == 0)
+                    nshards = sysconf(_SC_NPROCESSORS_ONLN);
+
+                if (nshards < 1 || nshards > SHARDSTORE_MAX_SHARDS) {
+                    usage(argv[0]);
+                    exit(-1);
+                }
+                break;
+            case 'r':
+                replication_port = optarg;
+                break;
+            case 'f':
+                leader_addr = optarg;
+                break;
+            default:
+                usage(argv[0]);
+                exit(-1);
+        }
+    }
+
+    /* replication streams a single data file, recovery and compression only cover a single data file */
+    if ((replication_port != NULL) + (leader_addr != NULL) + (nshards > 0) > 1 || ((persistent || compress) && nshards > 0)) {
+        usage(argv[0]);
+        exit(-1);
+    }
+
+    /* a follower on the leader's host would append to the leader's own data file */
+    if (leader_addr != NULL && !datafile_given) {
+        fprintf(stderr, "A follower needs its own data file, pass -w\n");
+        usage(argv[0]);
+        exit(-1);
+    }
+
+    /* take over the sockets of a running instance, or bind on our own, do this before daemonizing */
+    struct handoff_t handoff;
+    int sock = -1;
+    int datafd = -1;
+    int predecessor = -1;
 
-    if (argc > 1 && !strncmp(argv[1], "-d", 2)) {
-        daemonize = true;
+    if (handoff_path != NULL) {
+        handoff_init(&handoff, handoff_path);
+        predecessor = handoff_takeover(&handoff, &sock, &datafd);
     }
 
-    /* bind to socket, do this before daemonizing */
-    int sock = bind_to_port(default_port);
+    if (predecessor < 0)
+        sock = bind_to_port(port);
 
     if (sock < 0) {
         exit(-1);
@@ -183,48 +262,121 @@ int main(int argc, char* argv[]) {
         openlog(syslog_ident, LOG_PID, LOG_DAEMON);
     }
 
-    /* now start listening for connections */
-    if (listen(sock, 5) != 0) {
-        syslog(LOG_PERROR, "Error listening on port %s!", default_port);
+    /* the flusher thread would not survive daemonizing */
+    if (asynclog_start(loglevel) != 0) {
+        asynclog_write(LOG_ERR, "Error starting asynchronous logging");
+    }
+
+    /* now start listening for connections, a taken over socket is listening already */
+    if (listen(sock, SOMAXCONN) != 0) {
+        asynclog_write(LOG_ERR, "Error listening on port %s!", port);
         exit(-1);
     }
 
-    syslog(LOG_INFO, "Listening on %s\n", default_port);
+    asynclog_write(LOG_INFO, "Listening on %s\n", port);
 
     struct sockaddr clientaddr;
     socklen_t clientaddrlen = sizeof(clientaddr);
 
     struct threadlist_node_t *children = NULL;
 
-    pthread_mutex_t tmpfile_lock;
-    pthread_mutex_init(&tmpfile_lock, NULL);
+    struct shardstore_t shardstore;
+    if (nshards > 0) {
+        if (shardstore_init(&shardstore, tmpfilename, nshards, predecessor >= 0) != 0) {
+            asynclog_write(LOG_ERR, "Error opening %ld shards of %s", nshards, tmpfilename);
+            exit(-1);
+        }
+
+        asynclog_write(LOG_INFO, "Storing data in %ld shards", nshards);
+    }
+
+    struct coldstore_t coldstore;
+    if (compress && coldstore_open(&coldstore, tmpfilename, predecessor >= 0) != 0) {
+        asynclog_write(LOG_ERR, "Error opening cold segments of %s", tmpfilename);
+        exit(-1);
+    }
+
+    /* the predecessor still writes until it is drained, hold recovery and our appends back until then */
+    struct datalog_t datalog;
+    if (datalog_init(&datalog, tmpfilename, datafd, nshards > 0 ? &shardstore : NULL, compress ? &coldstore : NULL, persistent, predecessor >= 0) != 0) {
+        asynclog_write(LOG_ERR, "Error reading data file %s", tmpfilename);
+        exit(-1);
+    }
+
+    if (predecessor >= 0 && handoff_await(&handoff, predecessor, &datalog) != 0) {
+        asynclog_write(LOG_ERR, "Error waiting for predecessor, releasing appends");
+        close(predecessor);
+        datalog_release(&datalog);
+    }
+
+    if (handoff_path != NULL && handoff_listen(&handoff, sock, datalog.fd) != 0) {
+        asynclog_write(LOG_ERR, "Error accepting successors on %s", handoff_path);
+        exit(-1);
+    }
+
+    datalog.ring.policy = laggard_policy;
+
+    struct fairshare_t fairshare;
+    if (fairshare_init(&fairshare, append_rate, replay_rate, slots) != 0) {
+        asynclog_write(LOG_ERR, "Error setting up fair sharing");
+        exit(-1);
+    }
+
+    struct replication_leader_t leader;
+    if (replication_port != NULL && replication_leader_start(&leader, replication_port, &datalog) != 0) {
+        exit(-1);
+    }
+
+    /* followers are read-only replicas, timestamps arrive from the leader */
+    struct replication_follower_t follower;
+    bool read_only = leader_addr != NULL;
 
     timer_t timestamp_timer_id;
-    if (create_timestamp_timer(&timestamp_timer_id, &tmpfile_lock) != 0) {
-        syslog(LOG_PERROR, "Failed to arm timer");
+    if (read_only) {
+        if (replication_follower_start(&follower, leader_addr, &datalog) != 0) {
+            asynclog_write(LOG_ERR, "Error starting replication from %s", leader_addr);
+            exit(-1);
+        }
     }
+    else if (create_timestamp_timer(&timestamp_timer_id, &datalog) != 0) {
+        asynclog_write(LOG_ERR, "Failed to arm timer");
+    }
+
+    /* server loop, exited by signals or a handoff, negative descriptors are ignored by poll */
+    struct pollfd pfds[2] = {
+        { .fd = sock, .events = POLLIN },
+        { .fd = handoff_path != NULL ? handoff.listen_fd : -1, .events = POLLIN },
+    };
 
-    /* server loop, exited by signals */
     while (!_doexit) {
-        /* wait for connections */
+        if (poll(pfds, 2, 1000) <= 0)
+            continue;
+
+        /* the successor accepts on the same socket from now on */
+        if ((pfds[1].revents & POLLIN) && handoff_accept(&handoff) == 0)
+            break;
+
+        if (!(pfds[0].revents & POLLIN))
+            continue;
+
         int newsock = accept(sock, &clientaddr, &clientaddrlen);
 
         if (newsock < 0) {
-            syslog(LOG_PERROR, "Error accepting connection");
+            asynclog_conn(NULL, LOG_ERR, "Error accepting connection");
             continue;
         }
 
         char *clientip = get_addr_str(&clientaddr);
 
-        syslog(LOG_INFO, "Accepted connection from %s", clientip);
+        asynclog_conn(clientip, LOG_INFO, "Accepted connection from %s", clientip);
 
         struct threadlist_node_t *newborn = threadlist_node_create();
 
-        struct connection_handler_args_t *connection_handler_args = connection_handler_create_args(newsock, clientip, &tmpfile_lock);
+        struct connection_handler_args_t *connection_handler_args = connection_handler_create_args(newsock, clientip, &datalog, &fairshare, read_only, read_only ? &follower : NULL);
 
         /* spawn thread to handle connection */
         if (pthread_create(&newborn->thread_id, NULL, connection_handler, connection_handler_args) != 0) {
-            syslog(LOG_PERROR, "Error creating thread");
+            asynclog_write(LOG_ERR, "Error creating thread");
             connection_handler_destroy_args(&connection_handler_args);
             free(newborn);
             continue;
@@ -233,15 +385,63 @@ int main(int argc, char* argv[]) {
         threadlist_attach(&children, newborn);
     }
 
-    syslog(LOG_INFO, "Caught signal, exiting");
+    bool handed_off = false;
+
+    if (handoff_path != NULL) {
+        handoff_stop(&handoff);
+        handed_off = handoff_completed(&handoff);
+    }
+
+    if (!handed_off)
+        asynclog_write(LOG_INFO, "Caught signal, exiting");
+
+    /* give open connections some time to finish, the successor serves new ones already */
+    if (handed_off) {
+        for (int waited = 0; waited < HANDOFF_DRAIN_MS && threadlist_reap(&children) > 0; waited += 100)
+            usleep(100 * 1000);
+
+        threadlist_cancel(&children);
+    }
 
     /* Wait for remaining threads */
     threadlist_cleanup(&children);
+    fairshare_destroy(&fairshare);
+
+    if (replication_port != NULL)
+        replication_leader_stop(&leader);
+
+    if (read_only)
+        replication_follower_stop(&follower);
+    else
+        timer_delete(timestamp_timer_id);
 
     close(sock);
-    timer_delete(timestamp_timer_id);
-    pthread_mutex_destroy(&tmpfile_lock);
-    unlink(tmpfilename); /* remove tempfile, note: posix has special tempfiles for this... */
+    datalog_destroy(&datalog);
+
+    /* the data lives on in the successor */
+    if (nshards > 0) {
+        if (!handed_off)
+            shardstore_remove(&shardstore);
+
+        shardstore_destroy(&shardstore);
+    }
+
+    if (compress) {
+        if (!persistent && !handed_off)
+            coldstore_remove(&coldstore);
+
+        coldstore_close(&coldstore);
+    }
+
+    if (!persistent && !handed_off) {
+        unlink(tmpfilename); /* remove tempfile, note: posix has special tempfiles for this... */
+        persist_remove(tmpfilename);
+    }
+
+    if (handed_off)
+        handoff_notify_drained(&handoff);
+
+    asynclog_stop();
 
     exit(0);
 }
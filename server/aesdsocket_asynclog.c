@@ -0,0 +1,338 @@
+#include "aesdsocket_asynclog.h"
+
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+
+/*
+ * Single-producer single-consumer message ring, owned by one thread at a time.
+ * Rings of exited threads are orphaned and handed to the next new thread.
+ **/
+struct asynclog_entry_t {
+    unsigned long sequence; /* global order of queueing */
+    int priority;
+    char message[ASYNCLOG_MESSAGE_SIZE];
+};
+
+struct asynclog_ring_t {
+    struct asynclog_entry_t entries[ASYNCLOG_RING_ENTRIES];
+    atomic_size_t head; /* written by the owning thread */
+    atomic_size_t tail; /* written by the flusher */
+    atomic_bool orphaned;
+    size_t drain_head; /* head seen by the current drain, flusher only */
+    struct asynclog_ring_t *next;
+};
+
+
+static struct asynclog_ring_t *_Atomic rings = NULL;
+static atomic_int level = LOG_DEBUG;
+static atomic_bool running = false;
+static atomic_bool stopping = false;
+static atomic_ulong sequence = 0;
+static atomic_long conn_tokens[ASYNCLOG_CONN_BUCKETS];
+static atomic_ulong dropped_full = 0;
+static atomic_ulong dropped_rate = 0;
+
+static pthread_t flusher_id;
+static pthread_key_t ring_key;
+static __thread struct asynclog_ring_t *thread_ring = NULL;
+
+
+/*
+ * Thread exit destructor, hand the ring over to a future thread.
+ **/
+static void orphan_ring(void *ring) {
+    atomic_store(&((struct asynclog_ring_t *)ring)->orphaned, true);
+}
+
+
+/*
+ * Get the ring of the calling thread, adopting an orphan or creating one.
+ **/
+static struct asynclog_ring_t *get_ring() {
+    if (thread_ring != NULL)
+        return thread_ring;
+
+    for (struct asynclog_ring_t *ring = atomic_load(&rings); ring != NULL; ring = ring->next) {
+        bool expected = true;
+
+        if (atomic_compare_exchange_strong(&ring->orphaned, &expected, false)) {
+            thread_ring = ring;
+            break;
+        }
+    }
+
+    if (thread_ring == NULL) {
+        struct asynclog_ring_t *ring = calloc(1, sizeof(struct asynclog_ring_t));
+
+        if (ring == NULL)
+            return NULL;
+
+        /* rings are never removed, so prepending is the only concurrent change */
+        ring->next = atomic_load(&rings);
+        while (!atomic_compare_exchange_weak(&rings, &ring->next, ring))
+            ;
+
+        thread_ring = ring;
+    }
+
+    pthread_setspecific(ring_key, thread_ring);
+
+    return thread_ring;
+}
+
+
+/*
+ * Format a message into the ring of the calling thread.
+ **/
+static void enqueue(int priority, const char *format, va_list args) {
+    if (!atomic_load_explicit(&running, memory_order_acquire)) {
+        vsyslog(priority, format, args);
+        return;
+    }
+
+    struct asynclog_ring_t *ring = get_ring();
+
+    if (ring == NULL) {
+        atomic_fetch_add_explicit(&dropped_full, 1, memory_order_relaxed);
+        return;
+    }
+
+    size_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+
+    if (head - atomic_load_explicit(&ring->tail, memory_order_acquire) >= ASYNCLOG_RING_ENTRIES) {
+        atomic_fetch_add_explicit(&dropped_full, 1, memory_order_relaxed);
+        return;
+    }
+
+    struct asynclog_entry_t *entry = &ring->entries[head % ASYNCLOG_RING_ENTRIES];
+    entry->priority = priority;
+    vsnprintf(entry->message, sizeof(entry->message), format, args);
+    entry->sequence = atomic_fetch_add_explicit(&sequence, 1, memory_order_relaxed);
+
+    atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+}
+
+
+void asynclog_write(int priority, const char *format, ...) {
+    if (LOG_PRI(priority) > atomic_load_explicit(&level, memory_order_relaxed))
+        return;
+
+    va_list args;
+    va_start(args, format);
+    enqueue(priority, format, args);
+    va_end(args);
+}
+
+
+/*
+ * Token bucket of a client address, clients may share a bucket.
+ **/
+static atomic_long *conn_bucket(const char *client_ip) {
+    unsigned hash = 2166136261u; /* FNV-1a */
+
+    while (client_ip != NULL && *client_ip != '\0') {
+        hash ^= (unsigned char)*client_ip++;
+        hash *= 16777619u;
+    }
+
+    return &conn_tokens[hash % ASYNCLOG_CONN_BUCKETS];
+}
+
+
+/*
+ * Like asynclog_write(), for messages issued per connection.
+ * Dropped once the token bucket of the client, refilled by the flusher,
+ * runs dry, so a noisy client does not silence the others.
+ * client_ip may be NULL for messages without a client.
+ **/
+void asynclog_conn(const char *client_ip, int priority, const char *format, ...) {
+    if (LOG_PRI(priority) > atomic_load_explicit(&level, memory_order_relaxed))
+        return;
+
+    if (atomic_load_explicit(&running, memory_order_acquire)) {
+        atomic_long *bucket = conn_bucket(client_ip);
+        long tokens = atomic_load_explicit(bucket, memory_order_relaxed);
+
+        do {
+            if (tokens <= 0) {
+                atomic_fetch_add_explicit(&dropped_rate, 1, memory_order_relaxed);
+                return;
+            }
+        } while (!atomic_compare_exchange_weak(bucket, &tokens, tokens - 1));
+    }
+
+    va_list args;
+    va_start(args, format);
+    enqueue(priority, format, args);
+    va_end(args);
+}
+
+
+/*
+ * Forward all queued messages to syslog, merging the rings by sequence.
+ * Only messages queued before the drain started are forwarded, each ring
+ * is ordered already, so repeatedly taking the lowest ring front suffices.
+ **/
+static void drain_rings() {
+    /* rings are only ever prepended, the list from here on stays the same */
+    struct asynclog_ring_t *first = atomic_load(&rings);
+
+    for (struct asynclog_ring_t *ring = first; ring != NULL; ring = ring->next)
+        ring->drain_head = atomic_load_explicit(&ring->head, memory_order_acquire);
+
+    while (true) {
+        struct asynclog_ring_t *lowest = NULL;
+        struct asynclog_entry_t *entry = NULL;
+
+        for (struct asynclog_ring_t *ring = first; ring != NULL; ring = ring->next) {
+            size_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+
+            if (tail == ring->drain_head)
+                continue;
+
+            struct asynclog_entry_t *front = &ring->entries[tail % ASYNCLOG_RING_ENTRIES];
+
+            if (entry == NULL || front->sequence < entry->sequence) {
+                lowest = ring;
+                entry = front;
+            }
+        }
+
+        if (lowest == NULL)
+            break;
+
+        syslog(entry->priority, "%s", entry->message);
+        atomic_fetch_add_explicit(&lowest->tail, 1, memory_order_release);
+    }
+}
+
+
+/*
+ * Top up every client's token bucket by amount, up to the burst size.
+ **/
+static void refill_buckets(long amount) {
+    for (size_t i = 0; i < ASYNCLOG_CONN_BUCKETS; ++i) {
+        long tokens = atomic_load(&conn_tokens[i]);
+        long refilled;
+
+        do {
+            refilled = tokens + amount > ASYNCLOG_CONN_BURST ? ASYNCLOG_CONN_BURST : tokens + amount;
+        } while (!atomic_compare_exchange_weak(&conn_tokens[i], &tokens, refilled));
+    }
+}
+
+
+/*
+ * Report messages dropped since the last report, if any.
+ **/
+static void report_drops(unsigned long *reported_full, unsigned long *reported_rate) {
+    unsigned long full = atomic_load(&dropped_full), rate = atomic_load(&dropped_rate);
+
+    if (full != *reported_full || rate != *reported_rate) {
+        syslog(LOG_WARNING, "Dropped %lu log messages on full buffers, %lu by rate limit",
+            full - *reported_full, rate - *reported_rate);
+        *reported_full = full;
+        *reported_rate = rate;
+    }
+}
+
+
+/*
+ * Background thread flushing rings, refilling the rate limits
+ * and reporting dropped messages at most every ASYNCLOG_REPORT_MS.
+ **/
+static void *flusher(void *unused) {
+    const struct timespec interval = { .tv_sec = 0, .tv_nsec = ASYNCLOG_FLUSH_MS * 1000000L };
+    const long refill = ASYNCLOG_CONN_RATE * ASYNCLOG_FLUSH_MS / 1000;
+    unsigned long reported_full = 0, reported_rate = 0;
+    long since_report = 0;
+
+    while (!atomic_load(&stopping)) {
+        nanosleep(&interval, NULL);
+
+        refill_buckets(refill);
+        drain_rings();
+
+        since_report += ASYNCLOG_FLUSH_MS;
+
+        if (since_report >= ASYNCLOG_REPORT_MS) {
+            report_drops(&reported_full, &reported_rate);
+            since_report = 0;
+        }
+    }
+
+    drain_rings();
+    report_drops(&reported_full, &reported_rate);
+
+    return NULL;
+}
+
+
+/*
+ * Start the flusher, call after daemonizing.
+ * Return 0 on success or -1 on error.
+ **/
+int asynclog_start(int initial_level) {
+    asynclog_set_level(initial_level);
+
+    if (pthread_key_create(&ring_key, orphan_ring) != 0)
+        return -1;
+
+    atomic_store(&stopping, false);
+    refill_buckets(ASYNCLOG_CONN_BURST);
+
+    if (pthread_create(&flusher_id, NULL, flusher, NULL) != 0)
+        return -1;
+
+    atomic_store_explicit(&running, true, memory_order_release);
+
+    return 0;
+}
+
+
+/*
+ * Flush remaining messages and log synchronously from now on.
+ * Call after all other threads have stopped logging.
+ **/
+void asynclog_stop() {
+    if (!atomic_load(&running))
+        return;
+
+    atomic_store(&running, false);
+    atomic_store(&stopping, true);
+    pthread_join(flusher_id, NULL);
+}
+
+
+void asynclog_set_level(int new_level) {
+    if (new_level < LOG_EMERG)
+        new_level = LOG_EMERG;
+
+    if (new_level > LOG_DEBUG)
+        new_level = LOG_DEBUG;
+
+    atomic_store(&level, new_level);
+}
+
+
+/*
+ * Raise or lower verbosity, async-signal-safe.
+ **/
+void asynclog_adjust_level(int delta) {
+    int current = atomic_load(&level);
+    int adjusted = current + delta;
+
+    if (adjusted < LOG_EMERG)
+        adjusted = LOG_EMERG;
+
+    if (adjusted > LOG_DEBUG)
+        adjusted = LOG_DEBUG;
+
+    atomic_compare_exchange_strong(&level, &current, adjusted);
+}
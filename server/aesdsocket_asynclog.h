@@ -0,0 +1,39 @@
+#ifndef AESDSOCKET_ASYNCLOG_H
+#define AESDSOCKET_ASYNCLOG_H
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <syslog.h>
+
+/*
+ * Asynchronous syslog replacement.
+ * Every thread formats into its own lock-free ring, a background thread
+ * flushes all rings to syslog in the order the messages were queued.
+ * Messages are dropped and counted when a ring is full, per-connection
+ * messages are additionally rate limited per client address.
+ * Before asynclog_start() and after asynclog_stop() messages go to
+ * syslog directly.
+ **/
+#define ASYNCLOG_RING_ENTRIES 64
+#define ASYNCLOG_MESSAGE_SIZE 256
+#define ASYNCLOG_FLUSH_MS 100
+#define ASYNCLOG_CONN_RATE 100  /* per-client messages per second */
+#define ASYNCLOG_CONN_BURST 200
+#define ASYNCLOG_CONN_BUCKETS 256
+#define ASYNCLOG_REPORT_MS 1000 /* minimum interval of drop reports */
+
+int asynclog_start(int level);
+
+void asynclog_stop();
+
+void asynclog_set_level(int level);
+
+void asynclog_adjust_level(int delta);
+
+void asynclog_write(int priority, const char *format, ...) __attribute__((format(printf, 2, 3)));
+
+void asynclog_conn(const char *client_ip, int priority, const char *format, ...) __attribute__((format(printf, 3, 4)));
+
+#endif//AESDSOCKET_ASYNCLOG_H
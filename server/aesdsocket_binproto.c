@@ -0,0 +1,331 @@
+#include "aesdsocket_binproto.h"
+
+#include <arpa/inet.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include "aesdsocket_asynclog.h"
+#include "aesdsocket_coldstore.h"
+#include "aesdsocket_persist.h"
+#include "aesdsocket_shardstore.h"
+
+
+/*
+ * Session resources that need cleanup on exit.
+ **/
+struct binproto_res {
+    FILE *out;
+    char *payload;
+};
+
+
+static void destroy_binproto_res(void *args) {
+    struct binproto_res *res = (struct binproto_res *)args;
+
+    if (res->out) fclose(res->out);
+    if (res->payload) free(res->payload);
+}
+
+
+/*
+ * Write a response header.
+ * Return 0 on success or -1 on error.
+ **/
+static int send_response_header(FILE *socket, uint8_t status, uint32_t length) {
+    uint8_t header[BINPROTO_RESPONSE_HEADER_SIZE];
+    uint32_t netlength = htonl(length);
+
+    header[0] = status;
+    memcpy(header + 1, &netlength, sizeof(netlength));
+
+    return fwrite(header, sizeof(header), 1, socket) == 1 ? 0 : -1;
+}
+
+
+/*
+ * Split a batch payload into its records, pointing into the payload.
+ * Empty records are malformed, every record takes up log space.
+ * Return the number of records in *records, to be freed by the caller,
+ * or -1 on malformed batch or error.
+ **/
+static ssize_t unpack_batch(char *payload, size_t payloadlen, struct iovec **records) {
+    size_t readpos = 0, count = 0;
+
+    while (readpos < payloadlen) {
+        uint32_t reclen;
+
+        if (payloadlen - readpos < sizeof(reclen))
+            return -1;
+
+        memcpy(&reclen, payload + readpos, sizeof(reclen));
+        reclen = ntohl(reclen);
+        readpos += sizeof(reclen);
+
+        if (reclen == 0 || payloadlen - readpos < reclen)
+            return -1;
+
+        readpos += reclen;
+        ++count;
+    }
+
+    *records = malloc((count > 0 ? count : 1) * sizeof(struct iovec));
+
+    if (*records == NULL)
+        return -1;
+
+    readpos = 0;
+
+    for (size_t i = 0; i < count; ++i) {
+        uint32_t reclen;
+
+        memcpy(&reclen, payload + readpos, sizeof(reclen));
+        readpos += sizeof(reclen);
+
+        (*records)[i].iov_base = payload + readpos;
+        (*records)[i].iov_len = ntohl(reclen);
+        readpos += (*records)[i].iov_len;
+    }
+
+    return count;
+}
+
+
+/*
+ * Send exactly `bytes` from instream, scheduled in chunks.
+ * The slot is only held while reading the log, never while writing to
+ * a client that may not read, cancellation would leak it.
+ * Return 0 on success or -1 on error.
+ **/
+static int send_chunked(FILE *socket, FILE *instream, size_t bytes, struct fairshare_client_t *client) {
+    char buffer[FAIRSHARE_CHUNK];
+
+    while (bytes > 0) {
+        size_t chunklen = bytes < sizeof(buffer) ? bytes : sizeof(buffer);
+        int cancelstate;
+
+        fairshare_acquire(client, FAIRSHARE_REPLAY);
+        pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &cancelstate);
+        size_t readlen = fread(buffer, 1, chunklen, instream);
+        fairshare_release(client, FAIRSHARE_REPLAY, readlen);
+        pthread_setcancelstate(cancelstate, NULL);
+
+        if (readlen != chunklen || fwrite(buffer, 1, chunklen, socket) != chunklen)
+            return -1;
+
+        bytes -= chunklen;
+    }
+
+    return 0;
+}
+
+
+/*
+ * Send the whole log as gzip stream, stored cold segments go out as they are.
+ * The record lengths are sent ahead of it, see aesdsocket_binproto.h.
+ * A reset while sending fails the replay, the connection has to be closed
+ * since the announced length can no longer be met.
+ * Return number of payload bytes sent or -1 on error.
+ **/
+static ssize_t send_replay_gzip(FILE *socket, struct datalog_t *datalog, struct fairshare_client_t *client) {
+    struct datalog_pos_t pos = datalog_position(datalog);
+    struct coldstore_gzip_t gz;
+    size_t records = 0;
+
+    FILE *stream = coldstore_gzip_prepare(datalog->cold, pos.bytes, &gz) == 0 ? coldstore_gzip_fopen(datalog->cold, &gz) : NULL;
+    FILE *lengths = persist_find(datalog->persist, pos.bytes, &records) == 0 ? persist_fopen_records(datalog->persist, NULL, pos.bytes) : NULL;
+
+    if (stream == NULL || lengths == NULL) {
+        if (stream != NULL) fclose(stream);
+        if (lengths != NULL) fclose(lengths);
+        coldstore_gzip_free(&gz);
+        send_response_header(socket, BINPROTO_IO_ERROR, 0);
+        return -1;
+    }
+
+    size_t zbytes = gz.zbytes + gz.taillen;
+    size_t total = sizeof(uint32_t) * (records + 1) + zbytes;
+    uint32_t netrecords = htonl(records);
+    ssize_t sent = -1;
+
+    if (total > UINT32_MAX) {
+        send_response_header(socket, BINPROTO_TOO_LARGE, 0);
+    }
+    else if (send_response_header(socket, BINPROTO_GZIP, total) == 0
+             && fwrite(&netrecords, sizeof(netrecords), 1, socket) == 1
+             && send_chunked(socket, lengths, sizeof(uint32_t) * records, client) == 0
+             && send_chunked(socket, stream, zbytes, client) == 0) {
+        sent = total;
+    }
+
+    fclose(lengths);
+    fclose(stream);
+    coldstore_gzip_free(&gz);
+
+    return sent;
+}
+
+
+/*
+ * Send the whole log with a response header, scheduled in chunks.
+ * Every record is framed with its length, see aesdsocket_binproto.h.
+ * Return number of payload bytes sent or -1 on error.
+ **/
+static ssize_t send_replay(FILE *socket, struct datalog_t *datalog, struct fairshare_client_t *client, uint8_t flags) {
+    /* compressed replays are negotiated, only a log with cold storage offers them */
+    if ((flags & BINPROTO_FLAG_GZIP) && datalog->cold != NULL) {
+        return send_replay_gzip(socket, datalog, client);
+    }
+
+    FILE *datafile = NULL;
+    size_t bytes;
+
+    if (datalog->shards != NULL) {
+        struct shardstore_cut_t cut;
+        shardstore_snapshot(datalog->shards, &cut);
+        datafile = shardstore_fopen(datalog->shards, &cut, true);
+        bytes = cut.bytes + sizeof(uint32_t) * cut.records;
+    }
+    else {
+        size_t logbytes = datalog_position(datalog).bytes, records = 0;
+        FILE *data = coldstore_fopen(datalog->cold, datalog->filename);
+
+        /* the index may have grown meanwhile, count the records up to logbytes */
+        if (data != NULL && persist_find(datalog->persist, logbytes, &records) == 0)
+            datafile = persist_fopen_records(datalog->persist, data, logbytes);
+        else if (data != NULL)
+            fclose(data);
+
+        bytes = logbytes + sizeof(uint32_t) * records;
+    }
+
+    ssize_t result = -1;
+
+    if (bytes > UINT32_MAX) {
+        send_response_header(socket, BINPROTO_TOO_LARGE, 0);
+    }
+    else if (datafile == NULL && bytes > 0) {
+        send_response_header(socket, BINPROTO_IO_ERROR, 0);
+    }
+    else if (send_response_header(socket, BINPROTO_OK, bytes) == 0) {
+        /* the log may grow meanwhile, send exactly the announced length */
+        result = send_chunked(socket, datafile, bytes, client) == 0 ? (ssize_t)bytes : -1;
+    }
+
+    if (datafile != NULL)
+        fclose(datafile);
+
+    return result;
+}
+
+
+/*
+ * Serve binary requests until the client disconnects.
+ * The magic byte has already been consumed.
+ * Return number of bytes sent or -1 on error.
+ **/
+ssize_t binproto_serve(FILE *socket, struct datalog_t *datalog, struct fairshare_client_t *client, bool read_only, const char *client_ip) {
+    uint8_t header[BINPROTO_REQUEST_HEADER_SIZE];
+    struct binproto_res res = { 0 };
+    ssize_t transsum = 0;
+
+    pthread_cleanup_push(destroy_binproto_res, &res);
+
+    /*
+     * Writing to the socket stream would discard its buffered input,
+     * pipelined requests go on being read from it, responses go to a
+     * stream of their own, flushed per request.
+     **/
+    int outfd = dup(fileno(socket));
+    res.out = outfd >= 0 ? fdopen(outfd, "w") : NULL;
+
+    if (res.out == NULL) {
+        if (outfd >= 0) close(outfd);
+        transsum = -1;
+    }
+
+    while (res.out != NULL && fread(header, sizeof(header), 1, socket) == 1) {
+        uint8_t type = header[0], flags = header[1];
+        uint32_t length;
+
+        memcpy(&length, header + 2, sizeof(length));
+        length = ntohl(length);
+
+        if (length > BINPROTO_MAX_PAYLOAD) {
+            asynclog_conn(client_ip, LOG_ERR, "Frame of %u bytes from %s too large", length, client_ip);
+            send_response_header(res.out, BINPROTO_TOO_LARGE, 0);
+            transsum = -1;
+            break;
+        }
+
+        free(res.payload);
+        res.payload = malloc(length > 0 ? length : 1);
+
+        if (res.payload == NULL || fread(res.payload, 1, length, socket) != length) {
+            transsum = -1;
+            break;
+        }
+
+        struct iovec single = { .iov_base = res.payload, .iov_len = length };
+        struct iovec *records = &single;
+        ssize_t count = length > 0 ? 1 : 0;
+        int status = BINPROTO_OK;
+
+        switch (type) {
+            case BINPROTO_BATCH:
+                count = unpack_batch(res.payload, length, &records);
+
+                if (count < 0) {
+                    records = NULL;
+                    status = BINPROTO_BAD_FRAME;
+                    break;
+                }
+                /* fall through */
+            case BINPROTO_APPEND:
+                if (read_only) {
+                    status = BINPROTO_READ_ONLY;
+                }
+                else if (count > 0) {
+                    datalog_wait_released(datalog);
+                    fairshare_acquire(client, FAIRSHARE_APPEND);
+                    ssize_t appended = datalog_append_records(datalog, records, count);
+                    fairshare_release(client, FAIRSHARE_APPEND, appended > 0 ? appended : 0);
+
+                    if (appended == -1)
+                        status = BINPROTO_IO_ERROR;
+                    else
+                        asynclog_conn(client_ip, LOG_DEBUG, "Received %ld records from %s", count, client_ip);
+                }
+                break;
+            case BINPROTO_REPLAY:
+                flags |= BINPROTO_FLAG_REPLAY;
+                break;
+            default:
+                status = BINPROTO_BAD_FRAME;
+        }
+
+        if (records != &single)
+            free(records);
+
+        ssize_t sent;
+
+        if (status == BINPROTO_OK && (flags & BINPROTO_FLAG_REPLAY)) {
+            sent = send_replay(res.out, datalog, client, flags);
+        }
+        else {
+            sent = send_response_header(res.out, status, 0);
+        }
+
+        if (sent < 0 || fflush(res.out) != 0) {
+            transsum = -1;
+            break;
+        }
+
+        transsum += BINPROTO_RESPONSE_HEADER_SIZE + sent;
+    }
+
+    pthread_cleanup_pop(1);
+
+    return transsum;
+}
@@ -0,0 +1,66 @@
+#ifndef AESDSOCKET_BINPROTO_H
+#define AESDSOCKET_BINPROTO_H
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "aesdsocket_datalog.h"
+#include "aesdsocket_fairshare.h"
+
+/*
+ * Binary protocol, selected by sending BINPROTO_MAGIC as the first byte.
+ * Never a valid first byte of ASCII or UTF-8 text, so both protocols coexist.
+ * All integers are in network byte order, records are stored verbatim and
+ * may hold any bytes, the record index keeps their boundaries.
+ *
+ * Request:  type (u8) | flags (u8) | length (u32) | payload
+ *   BINPROTO_APPEND  payload is a single record, empty appends nothing
+ *   BINPROTO_BATCH   payload is a sequence of length (u32) | record,
+ *                    empty records are rejected with BINPROTO_BAD_FRAME
+ *   BINPROTO_REPLAY  no payload, response carries the whole log
+ *   BINPROTO_FLAG_REPLAY on APPEND/BATCH replies with the log after appending
+ *   BINPROTO_FLAG_GZIP asks for a gzip compressed replay, the server answers
+ *   with BINPROTO_GZIP if it compresses, BINPROTO_OK with a plain log if not
+ *
+ * Response: status (u8) | length (u32) | payload
+ *   BINPROTO_OK      replays are framed like batches, length (u32) | record
+ *   BINPROTO_GZIP    record count (u32) | length (u32) of every record |
+ *                    gzip stream of the unframed records
+ * Text connections replay the unframed records.
+ *
+ * The connection stays open for any number of requests.
+ **/
+#define BINPROTO_MAGIC 0xAE
+
+#define BINPROTO_REQUEST_HEADER_SIZE 6
+#define BINPROTO_RESPONSE_HEADER_SIZE 5
+#define BINPROTO_MAX_PAYLOAD (16 * 1024 * 1024)
+
+enum binproto_type_t {
+    BINPROTO_APPEND = 'A',
+    BINPROTO_BATCH = 'B',
+    BINPROTO_REPLAY = 'R',
+};
+
+enum binproto_flags_t {
+    BINPROTO_FLAG_REPLAY = 0x01,
+    BINPROTO_FLAG_GZIP = 0x02,
+};
+
+enum binproto_status_t {
+    BINPROTO_OK = 0,
+    BINPROTO_BAD_FRAME = 1,
+    BINPROTO_TOO_LARGE = 2,
+    BINPROTO_READ_ONLY = 3,
+    BINPROTO_IO_ERROR = 4,
+    BINPROTO_GZIP = 5, /* ok, payload is a gzip stream */
+};
+
+ssize_t binproto_serve(FILE *socket, struct datalog_t *datalog, struct fairshare_client_t *client, bool read_only, const char *client_ip);
+
+#endif//AESDSOCKET_BINPROTO_H
@@ -0,0 +1,111 @@
+#include "aesdsocket_broadcast.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+
+int broadcast_ring_init(struct broadcast_ring_t *ring, size_t capacity, enum broadcast_policy_t policy) {
+    ring->buffer = malloc(capacity);
+    ring->capacity = capacity;
+    ring->head = 0;
+    ring->evicted = '\n';
+    ring->policy = policy;
+
+    return ring->buffer != NULL ? 0 : -1;
+}
+
+
+void broadcast_ring_destroy(struct broadcast_ring_t *ring) {
+    free(ring->buffer);
+    ring->buffer = NULL;
+}
+
+
+/*
+ * Append to the ring, overwriting the oldest data.
+ **/
+void broadcast_ring_push(struct broadcast_ring_t *ring, const char *buffer, size_t buflen) {
+    size_t oldest = broadcast_ring_oldest(ring);
+    size_t newhead = ring->head + buflen;
+    size_t newoldest = newhead > ring->capacity ? newhead - ring->capacity : 0;
+
+    /* remember the byte just before the new oldest one, before it is gone */
+    if (newoldest > oldest) {
+        size_t last = newoldest - 1;
+        ring->evicted = last >= ring->head ? buffer[last - ring->head] : ring->buffer[last % ring->capacity];
+    }
+
+    ring->head = newhead;
+
+    /* only the last `capacity` bytes survive */
+    if (buflen > ring->capacity) {
+        buffer += buflen - ring->capacity;
+        buflen = ring->capacity;
+    }
+
+    size_t start = (ring->head - buflen) % ring->capacity;
+    size_t firstlen = ring->capacity - start;
+
+    if (firstlen > buflen)
+        firstlen = buflen;
+
+    memcpy(ring->buffer + start, buffer, firstlen);
+    memcpy(ring->buffer, buffer + firstlen, buflen - firstlen);
+}
+
+
+/*
+ * Return the stream offset of the oldest byte still buffered.
+ **/
+size_t broadcast_ring_oldest(const struct broadcast_ring_t *ring) {
+    return ring->head > ring->capacity ? ring->head - ring->capacity : 0;
+}
+
+
+/*
+ * Move a lagging cursor to the start of the oldest complete record.
+ * Return number of bytes skipped.
+ **/
+size_t broadcast_ring_resync(const struct broadcast_ring_t *ring, size_t *cursor) {
+    size_t oldest = broadcast_ring_oldest(ring);
+    size_t pos = oldest;
+
+    /* the record at `oldest` may be cut off, then start after the next newline */
+    if (ring->evicted != '\n') {
+        while (pos < ring->head && ring->buffer[pos % ring->capacity] != '\n')
+            ++pos;
+
+        pos = pos < ring->head ? pos + 1 : oldest;
+    }
+
+    size_t skipped = pos - *cursor;
+    *cursor = pos;
+
+    return skipped;
+}
+
+
+/*
+ * Copy data from cursor up to head into buffer and advance the cursor.
+ * Cursor must not be older than broadcast_ring_oldest().
+ * Return number of bytes copied.
+ **/
+size_t broadcast_ring_read(const struct broadcast_ring_t *ring, size_t *cursor, char *buffer, size_t buflen) {
+    size_t avail = ring->head - *cursor;
+
+    if (buflen > avail)
+        buflen = avail;
+
+    size_t start = *cursor % ring->capacity;
+    size_t firstlen = ring->capacity - start;
+
+    if (firstlen > buflen)
+        firstlen = buflen;
+
+    memcpy(buffer, ring->buffer + start, firstlen);
+    memcpy(buffer + firstlen, ring->buffer, buflen - firstlen);
+
+    *cursor += buflen;
+
+    return buflen;
+}
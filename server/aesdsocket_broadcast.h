@@ -0,0 +1,43 @@
+#ifndef AESDSOCKET_BROADCAST_H
+#define AESDSOCKET_BROADCAST_H
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <stddef.h>
+
+/*
+ * What to do with subscribers that fall behind the ring
+ **/
+enum broadcast_policy_t {
+    BROADCAST_DROP,       /* skip to the oldest complete record still buffered */
+    BROADCAST_DISCONNECT, /* close the subscription */
+};
+
+/*
+ * Fixed size byte ring shared by all subscribers.
+ * Positions are absolute stream offsets, each subscriber owns its cursor.
+ * Not synchronized, the owner serializes access.
+ **/
+struct broadcast_ring_t {
+    char *buffer;
+    size_t capacity;
+    size_t head; /* stream offset of the next byte pushed */
+    char evicted; /* last byte overwritten, a newline if the oldest byte starts a record */
+    enum broadcast_policy_t policy;
+};
+
+int broadcast_ring_init(struct broadcast_ring_t *ring, size_t capacity, enum broadcast_policy_t policy);
+
+void broadcast_ring_destroy(struct broadcast_ring_t *ring);
+
+void broadcast_ring_push(struct broadcast_ring_t *ring, const char *buffer, size_t buflen);
+
+size_t broadcast_ring_oldest(const struct broadcast_ring_t *ring);
+
+size_t broadcast_ring_resync(const struct broadcast_ring_t *ring, size_t *cursor);
+
+size_t broadcast_ring_read(const struct broadcast_ring_t *ring, size_t *cursor, char *buffer, size_t buflen);
+
+#endif//AESDSOCKET_BROADCAST_H
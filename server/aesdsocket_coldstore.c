@@ -0,0 +1,904 @@
+#include "aesdsocket_coldstore.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "aesdsocket_asynclog.h"
+#include "aesdsocket_persist.h"
+
+
+/*
+ * State of a stream opened with coldstore_fopen()
+ **/
+struct coldstore_reader_t {
+    struct coldstore_t *cold;
+    int fd;
+    off_t pos;
+    z_stream zs;           /* inflating `segment` */
+    bool inflating;
+    ssize_t segment;       /* index of the segment being inflated, -1 if none */
+    unsigned generation;
+    size_t rawpos;         /* bytes of the segment inflated so far */
+    size_t zpos;           /* bytes of its member read so far */
+    char zbuf[COLDSTORE_READ_CHUNK];
+};
+
+
+/*
+ * Compress a buffer into a single gzip member.
+ * Return its length, with *out to be freed, or -1 on error.
+ **/
+static ssize_t gzip_compress(const char *in, size_t inlen, int level, char **out) {
+    z_stream zs = { 0 };
+
+    if (deflateInit2(&zs, level, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+        return -1;
+
+    size_t bound = deflateBound(&zs, inlen);
+    *out = malloc(bound);
+
+    if (*out == NULL) {
+        deflateEnd(&zs);
+        return -1;
+    }
+
+    zs.next_in = (Bytef *)in;
+    zs.avail_in = inlen;
+    zs.next_out = (Bytef *)*out;
+    zs.avail_out = bound;
+
+    int result = deflate(&zs, Z_FINISH);
+    ssize_t outlen = zs.total_out;
+
+    deflateEnd(&zs);
+
+    if (result != Z_STREAM_END) {
+        free(*out);
+        *out = NULL;
+        return -1;
+    }
+
+    return outlen;
+}
+
+
+/*
+ * Append a block to the in-memory list. Call with the write lock held.
+ * Return 0 on success or -1 on error.
+ **/
+static int add_block(struct coldstore_t *cold, const struct coldstore_header_t *header, off_t zoffset) {
+    if (cold->nblocks == cold->capacity) {
+        size_t capacity = cold->capacity ? 2 * cold->capacity : 64;
+        struct coldstore_block_t *blocks = realloc(cold->blocks, capacity * sizeof(struct coldstore_block_t));
+
+        if (blocks == NULL)
+            return -1;
+
+        cold->blocks = blocks;
+        cold->capacity = capacity;
+    }
+
+    cold->blocks[cold->nblocks++] = (struct coldstore_block_t){
+        .offset = header->offset,
+        .rawlen = header->rawlen,
+        .zoffset = zoffset,
+        .zlen = header->zlen,
+    };
+
+    cold->bytes += header->rawlen;
+    cold->end = zoffset + header->zlen;
+
+    return 0;
+}
+
+
+/*
+ * Read the blocks after the known ones and cut off a torn tail,
+ * unless another process may still be writing it.
+ * Call with the write lock held.
+ * Return 0 on success or -1 on error.
+ **/
+static int load_blocks(struct coldstore_t *cold, bool truncate) {
+    struct coldstore_header_t header;
+    off_t pos = cold->end;
+
+    while (pread(cold->fd, &header, sizeof(header), pos) == sizeof(header)) {
+        if (header.magic != COLDSTORE_MAGIC || header.offset != cold->bytes || header.rawlen != COLDSTORE_SEGMENT_SIZE)
+            break;
+
+        char *zdata = malloc(header.zlen);
+        bool valid = zdata != NULL
+            && pread(cold->fd, zdata, header.zlen, pos + sizeof(header)) == header.zlen
+            && persist_crc32(0, zdata, header.zlen) == header.crc;
+
+        free(zdata);
+
+        if (!valid || add_block(cold, &header, pos + sizeof(header)) != 0)
+            break;
+
+        pos = cold->end;
+    }
+
+    return truncate ? ftruncate(cold->fd, cold->end) : 0;
+}
+
+
+/*
+ * Forget the open tail member.
+ **/
+static void drop_tail(struct coldstore_tail_t *tail) {
+    if (tail->active)
+        deflateEnd(&tail->zs);
+
+    free(tail->data);
+    memset(tail, 0, sizeof(*tail));
+}
+
+
+/*
+ * Forget all blocks. Call with the write lock held.
+ **/
+static void drop_blocks(struct coldstore_t *cold) {
+    cold->nblocks = 0;
+    cold->bytes = 0;
+    cold->end = 0;
+    cold->generation++;
+}
+
+
+/*
+ * Open the cold file next to `filename` and load its valid blocks.
+ * With `held` set another process still compacts into the same file,
+ * nothing is cut off until coldstore_reload().
+ * Return 0 on success or -1 on error.
+ **/
+int coldstore_open(struct coldstore_t *cold, const char *filename, bool held) {
+    memset(cold, 0, sizeof(struct coldstore_t));
+    cold->filename = filename;
+    cold->fd = -1;
+    cold->datafd = -1;
+
+    if (asprintf(&cold->coldname, "%s.cold", filename) < 0) {
+        cold->coldname = NULL;
+        return -1;
+    }
+
+    cold->fd = open(cold->coldname, O_RDWR|O_CREAT, 0644);
+    cold->datafd = open(filename, O_RDWR|O_CREAT, 0644);
+
+    if (cold->fd < 0 || cold->datafd < 0)
+        return -1;
+
+    pthread_condattr_t condattr;
+    pthread_condattr_init(&condattr);
+    pthread_condattr_setclock(&condattr, CLOCK_MONOTONIC);
+
+    pthread_rwlock_init(&cold->lock, NULL);
+    pthread_mutex_init(&cold->cache_lock, NULL);
+    pthread_mutex_init(&cold->wake_lock, NULL);
+    pthread_cond_init(&cold->wake, &condattr);
+
+    pthread_condattr_destroy(&condattr);
+
+    if (load_blocks(cold, !held) != 0)
+        return -1;
+
+    struct stat datastat;
+
+    if (fstat(cold->datafd, &datastat) != 0)
+        return -1;
+
+    /* the data file was replaced, its segments are gone for good */
+    if (!held && (size_t)datastat.st_size < cold->bytes) {
+        asynclog_write(LOG_ERR, "Data file is shorter than its cold segments, dropping them");
+        drop_blocks(cold);
+
+        if (ftruncate(cold->fd, 0) != 0)
+            return -1;
+    }
+
+    if (cold->nblocks > 0) {
+        asynclog_write(LOG_INFO, "Loaded %zu cold segments, %zu bytes compressed to %jd",
+            cold->nblocks, cold->bytes, (intmax_t)cold->end);
+    }
+
+    return 0;
+}
+
+
+/*
+ * Pick up blocks another process added, i.e. after a hot restart.
+ * Return 0 on success or -1 on error.
+ **/
+int coldstore_reload(struct coldstore_t *cold) {
+    pthread_rwlock_wrlock(&cold->lock);
+    int result = load_blocks(cold, true);
+    pthread_rwlock_unlock(&cold->lock);
+
+    return result;
+}
+
+
+/*
+ * Drop blocks beyond a data file that recovery cut short.
+ **/
+void coldstore_truncate(struct coldstore_t *cold, size_t bytes) {
+    pthread_rwlock_wrlock(&cold->lock);
+
+    size_t dropped = 0;
+
+    while (cold->nblocks > 0) {
+        struct coldstore_block_t *last = &cold->blocks[cold->nblocks - 1];
+
+        if (last->offset + last->rawlen <= bytes)
+            break;
+
+        cold->bytes -= last->rawlen;
+        cold->end = last->zoffset - sizeof(struct coldstore_header_t);
+        cold->nblocks--;
+        dropped++;
+    }
+
+    if (dropped > 0) {
+        asynclog_write(LOG_ERR, "Dropped %zu cold segments beyond the recovered log", dropped);
+        cold->generation++;
+
+        if (ftruncate(cold->fd, cold->end) != 0)
+            asynclog_write(LOG_ERR, "Error truncating %s", cold->coldname);
+    }
+
+    pthread_rwlock_unlock(&cold->lock);
+}
+
+
+/*
+ * Drop all blocks along with the data file, see datalog_reset().
+ * Return 0 on success or -1 on error.
+ **/
+int coldstore_reset(struct coldstore_t *cold) {
+    pthread_rwlock_wrlock(&cold->lock);
+    drop_blocks(cold);
+    int result = ftruncate(cold->fd, 0);
+    pthread_rwlock_unlock(&cold->lock);
+
+    pthread_mutex_lock(&cold->cache_lock);
+    drop_tail(&cold->tail);
+    pthread_mutex_unlock(&cold->cache_lock);
+
+    return result;
+}
+
+
+void coldstore_close(struct coldstore_t *cold) {
+    if (cold->fd >= 0) close(cold->fd);
+    if (cold->datafd >= 0) close(cold->datafd);
+
+    free(cold->blocks);
+    drop_tail(&cold->tail);
+    free(cold->coldname);
+
+    pthread_cond_destroy(&cold->wake);
+    pthread_mutex_destroy(&cold->wake_lock);
+    pthread_mutex_destroy(&cold->cache_lock);
+    pthread_rwlock_destroy(&cold->lock);
+}
+
+
+void coldstore_remove(struct coldstore_t *cold) {
+    unlink(cold->coldname);
+}
+
+
+/*
+ * Compress the segment at `offset` and punch it out of the data file.
+ * Return 0 on success or -1 on error.
+ **/
+static int compact_segment(struct coldstore_t *cold, size_t offset, unsigned generation) {
+    char *raw = malloc(COLDSTORE_SEGMENT_SIZE);
+    char *zdata = NULL;
+    int result = -1;
+
+    if (raw == NULL || pread(cold->datafd, raw, COLDSTORE_SEGMENT_SIZE, offset) != COLDSTORE_SEGMENT_SIZE) {
+        free(raw);
+        return -1;
+    }
+
+    ssize_t zlen = gzip_compress(raw, COLDSTORE_SEGMENT_SIZE, Z_DEFAULT_COMPRESSION, &zdata);
+    free(raw);
+
+    if (zlen < 0)
+        return -1;
+
+    struct coldstore_header_t header = {
+        .magic = COLDSTORE_MAGIC,
+        .zlen = zlen,
+        .offset = offset,
+        .rawlen = COLDSTORE_SEGMENT_SIZE,
+        .crc = persist_crc32(0, zdata, zlen),
+    };
+
+    struct iovec iov[2] = {
+        { .iov_base = &header, .iov_len = sizeof(header) },
+        { .iov_base = zdata, .iov_len = zlen },
+    };
+
+    pthread_rwlock_rdlock(&cold->lock);
+    off_t end = cold->end;
+    pthread_rwlock_unlock(&cold->lock);
+
+    /* the block must be on disk before its data leaves the data file */
+    if (pwritev(cold->fd, iov, 2, end) == (ssize_t)(sizeof(header) + zlen) && fdatasync(cold->fd) == 0) {
+        pthread_rwlock_wrlock(&cold->lock);
+
+        /* a reset in the meantime makes the segment stale */
+        if (generation == cold->generation && offset == cold->bytes && end == cold->end && add_block(cold, &header, end + sizeof(header)) == 0) {
+            /* punch while still locked, so no reader and no reset is in between */
+            if (fallocate(cold->datafd, FALLOC_FL_PUNCH_HOLE|FALLOC_FL_KEEP_SIZE, offset, COLDSTORE_SEGMENT_SIZE) != 0)
+                asynclog_write(LOG_WARNING, "Error punching cold segment out of %s: %s", cold->filename, strerror(errno));
+
+            result = 0;
+        }
+
+        pthread_rwlock_unlock(&cold->lock);
+    }
+
+    if (result == 0)
+        asynclog_write(LOG_DEBUG, "Compressed segment at %zu to %zd bytes", offset, zlen);
+
+    free(zdata);
+
+    return result;
+}
+
+
+/*
+ * Compress all full segments that can no longer change.
+ * In persistent mode only checkpointed data counts, recovery must
+ * never have to verify a compressed segment.
+ **/
+static void compact(struct coldstore_t *cold) {
+    struct datalog_t *datalog = cold->datalog;
+
+    while (!atomic_load(&cold->stopping)) {
+        pthread_mutex_lock(&datalog->lock);
+
+        /* another process still appends during a hot restart */
+        size_t stable = 0;
+
+        if (!atomic_load(&datalog->held))
+            stable = datalog->persist != NULL && datalog->persist->durable ? datalog->persist->checkpoint_bytes : datalog->bytes;
+
+        unsigned generation = cold->generation;
+
+        pthread_mutex_unlock(&datalog->lock);
+
+        pthread_rwlock_rdlock(&cold->lock);
+        size_t offset = cold->bytes;
+        pthread_rwlock_unlock(&cold->lock);
+
+        if (offset + COLDSTORE_SEGMENT_SIZE > stable || compact_segment(cold, offset, generation) != 0)
+            break;
+    }
+}
+
+
+/*
+ * Thread function compressing cold segments in the background
+ **/
+static void *coldstore_compactor(void *cold_ptr) {
+    struct coldstore_t *cold = (struct coldstore_t *)cold_ptr;
+
+    pthread_mutex_lock(&cold->wake_lock);
+
+    while (!atomic_load(&cold->stopping)) {
+        struct timespec deadline;
+        clock_gettime(CLOCK_MONOTONIC, &deadline);
+        deadline.tv_sec += COLDSTORE_INTERVAL_MS / 1000;
+        deadline.tv_nsec += (COLDSTORE_INTERVAL_MS % 1000) * 1000000L;
+
+        if (deadline.tv_nsec >= 1000000000L) {
+            deadline.tv_sec += 1;
+            deadline.tv_nsec -= 1000000000L;
+        }
+
+        pthread_cond_timedwait(&cold->wake, &cold->wake_lock, &deadline);
+        pthread_mutex_unlock(&cold->wake_lock);
+
+        compact(cold);
+
+        pthread_mutex_lock(&cold->wake_lock);
+    }
+
+    pthread_mutex_unlock(&cold->wake_lock);
+
+    return NULL;
+}
+
+
+/*
+ * Start compressing cold segments of `datalog` in the background.
+ * Return 0 on success or -1 on error.
+ **/
+int coldstore_start(struct coldstore_t *cold, struct datalog_t *datalog) {
+    cold->datalog = datalog;
+    atomic_init(&cold->stopping, false);
+
+    if (pthread_create(&cold->compactor_id, NULL, coldstore_compactor, cold) != 0)
+        return -1;
+
+    cold->running = true;
+    return 0;
+}
+
+
+void coldstore_stop(struct coldstore_t *cold) {
+    if (!cold->running)
+        return;
+
+    pthread_mutex_lock(&cold->wake_lock);
+    atomic_store(&cold->stopping, true);
+    pthread_cond_signal(&cold->wake);
+    pthread_mutex_unlock(&cold->wake_lock);
+
+    pthread_join(cold->compactor_id, NULL);
+    cold->running = false;
+}
+
+
+/*
+ * Inflate the next `want` bytes of the reader's segment into buf,
+ * reading its member in chunks. Call with the lock held.
+ * Return number of bytes inflated, less than `want` on error.
+ **/
+static size_t inflate_chunk(struct coldstore_reader_t *reader, const struct coldstore_block_t *block, char *buf, size_t want) {
+    reader->zs.next_out = (Bytef *)buf;
+    reader->zs.avail_out = want;
+
+    while (reader->zs.avail_out > 0) {
+        if (reader->zs.avail_in == 0) {
+            size_t readlen = block->zlen - reader->zpos < sizeof(reader->zbuf) ? block->zlen - reader->zpos : sizeof(reader->zbuf);
+
+            if (readlen == 0 || pread(reader->cold->fd, reader->zbuf, readlen, block->zoffset + reader->zpos) != (ssize_t)readlen)
+                break;
+
+            reader->zs.next_in = (Bytef *)reader->zbuf;
+            reader->zs.avail_in = readlen;
+            reader->zpos += readlen;
+        }
+
+        if (inflate(&reader->zs, Z_NO_FLUSH) != Z_OK)
+            break;
+    }
+
+    size_t inflated = want - reader->zs.avail_out;
+    reader->rawpos += inflated;
+
+    return inflated;
+}
+
+
+/*
+ * Read from a cold segment at the reader's position, continuing the
+ * inflate of the previous read, so no segment is held in memory.
+ * Call with the lock held.
+ * Return number of bytes read or -1 on error.
+ **/
+static ssize_t inflate_segment(struct coldstore_reader_t *reader, size_t segment, char *buf, size_t size) {
+    struct coldstore_t *cold = reader->cold;
+    const struct coldstore_block_t *block = &cold->blocks[segment];
+    size_t skip = reader->pos - block->offset;
+
+    /* start over on another segment, after a reset or when seeking backwards */
+    if (!reader->inflating || reader->segment != (ssize_t)segment || reader->generation != cold->generation || reader->rawpos > skip) {
+        if (reader->inflating)
+            inflateEnd(&reader->zs);
+
+        memset(&reader->zs, 0, sizeof(reader->zs));
+        reader->inflating = inflateInit2(&reader->zs, 15 + 16) == Z_OK;
+        reader->segment = segment;
+        reader->generation = cold->generation;
+        reader->rawpos = 0;
+        reader->zpos = 0;
+
+        if (!reader->inflating)
+            return -1;
+    }
+
+    /* seeking forward inflates into buf and throws it away */
+    while (reader->rawpos < skip) {
+        size_t want = skip - reader->rawpos < size ? skip - reader->rawpos : size;
+
+        if (inflate_chunk(reader, block, buf, want) != want)
+            break;
+    }
+
+    size_t want = block->rawlen - skip < size ? block->rawlen - skip : size;
+
+    if (reader->rawpos != skip || inflate_chunk(reader, block, buf, want) != want) {
+        asynclog_write(LOG_ERR, "Corrupt cold segment at offset %zu of %s", block->offset, cold->coldname);
+        reader->segment = -1;
+        return -1;
+    }
+
+    return want;
+}
+
+
+static ssize_t reader_read(void *cookie, char *buf, size_t size) {
+    struct coldstore_reader_t *reader = (struct coldstore_reader_t *)cookie;
+    struct coldstore_t *cold = reader->cold;
+    ssize_t result = -1;
+    int cancelstate;
+
+    /* cancellation in pread() would leave the lock held and hang the compactor */
+    pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &cancelstate);
+    pthread_rwlock_rdlock(&cold->lock);
+
+    if ((size_t)reader->pos < cold->bytes)
+        result = inflate_segment(reader, reader->pos / COLDSTORE_SEGMENT_SIZE, buf, size);
+    else
+        result = pread(reader->fd, buf, size, reader->pos);
+
+    pthread_rwlock_unlock(&cold->lock);
+    pthread_setcancelstate(cancelstate, NULL);
+
+    if (result > 0)
+        reader->pos += result;
+
+    return result;
+}
+
+
+static int reader_seek(void *cookie, off64_t *offset, int whence) {
+    struct coldstore_reader_t *reader = (struct coldstore_reader_t *)cookie;
+    struct stat datastat;
+    off_t base;
+
+    switch (whence) {
+        case SEEK_SET:
+            base = 0;
+            break;
+        case SEEK_CUR:
+            base = reader->pos;
+            break;
+        case SEEK_END:
+            if (fstat(reader->fd, &datastat) != 0)
+                return -1;
+
+            base = datastat.st_size;
+            break;
+        default:
+            errno = EINVAL;
+            return -1;
+    }
+
+    if (base + *offset < 0) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    reader->pos = base + *offset;
+    *offset = reader->pos;
+
+    return 0;
+}
+
+
+static int reader_close(void *cookie) {
+    struct coldstore_reader_t *reader = (struct coldstore_reader_t *)cookie;
+
+    if (reader->inflating)
+        inflateEnd(&reader->zs);
+
+    close(reader->fd);
+    free(reader);
+
+    return 0;
+}
+
+
+/*
+ * Open the data file for reading, cold segments included.
+ * Without `cold` this is a plain fopen().
+ * Return the stream or NULL on error.
+ **/
+FILE *coldstore_fopen(struct coldstore_t *cold, const char *filename) {
+    if (cold == NULL)
+        return fopen(filename, "r");
+
+    struct coldstore_reader_t *reader = calloc(1, sizeof(struct coldstore_reader_t));
+
+    if (reader == NULL)
+        return NULL;
+
+    reader->cold = cold;
+    reader->segment = -1;
+    reader->fd = open(filename, O_RDONLY);
+
+    if (reader->fd < 0) {
+        free(reader);
+        return NULL;
+    }
+
+    cookie_io_functions_t functions = {
+        .read = reader_read,
+        .seek = reader_seek,
+        .close = reader_close,
+    };
+
+    FILE *file = fopencookie(reader, "r", functions);
+
+    if (file == NULL)
+        reader_close(reader);
+
+    return file;
+}
+
+
+/*
+ * Append deflate output to the tail member.
+ * Return 0 on success or -1 on error.
+ **/
+static int tail_output(struct coldstore_tail_t *tail, const char *out, size_t outlen) {
+    if (tail->len + outlen > tail->capacity) {
+        size_t capacity = tail->capacity ? 2 * tail->capacity : COLDSTORE_READ_CHUNK;
+
+        while (capacity < tail->len + outlen)
+            capacity *= 2;
+
+        char *data = realloc(tail->data, capacity);
+
+        if (data == NULL)
+            return -1;
+
+        tail->data = data;
+        tail->capacity = capacity;
+    }
+
+    memcpy(tail->data + tail->len, out, outlen);
+    tail->len += outlen;
+
+    return 0;
+}
+
+
+/*
+ * Extend the open tail member from `start` up to `bytes` of the log,
+ * starting a new one if the segments moved on or the log was reset.
+ * Call with the cache lock held.
+ * Return 0 when the tail covers exactly [start, bytes) or -1 if not.
+ **/
+static int extend_tail(struct coldstore_t *cold, size_t start, size_t bytes, unsigned generation) {
+    struct coldstore_tail_t *tail = &cold->tail;
+
+    if (!tail->active || tail->start != start || tail->generation != generation) {
+        drop_tail(tail);
+
+        if (deflateInit2(&tail->zs, COLDSTORE_TAIL_LEVEL, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+            return -1;
+
+        tail->active = true;
+        tail->generation = generation;
+        tail->start = start;
+        tail->end = start;
+    }
+
+    /* a replay that raced with a newer one, its end is compressed already */
+    if (tail->end > bytes)
+        return -1;
+
+    if (tail->end == bytes)
+        return 0;
+
+    FILE *file = coldstore_fopen(cold, cold->filename);
+    bool complete = file != NULL && fseeko(file, tail->end, SEEK_SET) == 0;
+    char in[COLDSTORE_READ_CHUNK], out[COLDSTORE_READ_CHUNK];
+
+    while (complete && tail->end < bytes) {
+        size_t readlen = bytes - tail->end < sizeof(in) ? bytes - tail->end : sizeof(in);
+
+        complete = fread(in, 1, readlen, file) == readlen;
+        tail->zs.next_in = (Bytef *)in;
+        tail->zs.avail_in = complete ? readlen : 0;
+        tail->end += complete ? readlen : 0;
+
+        /* the flush leaves the member byte aligned at `end` */
+        int flush = tail->end == bytes ? Z_SYNC_FLUSH : Z_NO_FLUSH;
+
+        do {
+            tail->zs.next_out = (Bytef *)out;
+            tail->zs.avail_out = sizeof(out);
+
+            complete = complete && deflate(&tail->zs, flush) != Z_STREAM_ERROR
+                && tail_output(tail, out, sizeof(out) - tail->zs.avail_out) == 0;
+        } while (complete && tail->zs.avail_out == 0);
+    }
+
+    if (file != NULL)
+        fclose(file);
+
+    if (!complete) {
+        drop_tail(tail);
+        return -1;
+    }
+
+    return 0;
+}
+
+
+/*
+ * Complete a copy of the open tail member, the original stays open
+ * for later replays. Call with the cache lock held.
+ * Return its length, with *member to be freed, or -1 on error.
+ **/
+static ssize_t finish_tail(struct coldstore_tail_t *tail, char **member) {
+    z_stream zs;
+
+    if (deflateCopy(&zs, &tail->zs) != Z_OK)
+        return -1;
+
+    size_t bound = tail->len + deflateBound(&zs, 0);
+    *member = malloc(bound);
+
+    if (*member == NULL) {
+        deflateEnd(&zs);
+        return -1;
+    }
+
+    memcpy(*member, tail->data, tail->len);
+
+    zs.next_in = NULL;
+    zs.avail_in = 0;
+    zs.next_out = (Bytef *)*member + tail->len;
+    zs.avail_out = bound - tail->len;
+
+    int result = deflate(&zs, Z_FINISH);
+    ssize_t len = bound - zs.avail_out;
+
+    deflateEnd(&zs);
+
+    if (result != Z_STREAM_END) {
+        free(*member);
+        *member = NULL;
+        return -1;
+    }
+
+    return len;
+}
+
+
+/*
+ * Collect the stored members covering the first `bytes` of the log
+ * and compress the rest, extending the tail member of earlier replays.
+ * Return 0 on success or -1 on error.
+ **/
+int coldstore_gzip_prepare(struct coldstore_t *cold, size_t bytes, struct coldstore_gzip_t *gz) {
+    memset(gz, 0, sizeof(*gz));
+
+    pthread_rwlock_rdlock(&cold->lock);
+
+    while (gz->nblocks < cold->nblocks && cold->blocks[gz->nblocks].offset + cold->blocks[gz->nblocks].rawlen <= bytes) {
+        gz->zbytes += cold->blocks[gz->nblocks].zlen;
+        gz->nblocks++;
+    }
+
+    size_t start = gz->nblocks > 0 ? cold->blocks[gz->nblocks - 1].offset + cold->blocks[gz->nblocks - 1].rawlen : 0;
+    unsigned generation = cold->generation;
+    gz->generation = generation;
+
+    pthread_rwlock_unlock(&cold->lock);
+
+    ssize_t zlen = -1;
+    int cancelstate;
+
+    /* cancellation while reading the log would leave the cache locked */
+    pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &cancelstate);
+    pthread_mutex_lock(&cold->cache_lock);
+
+    if (extend_tail(cold, start, bytes, generation) == 0)
+        zlen = finish_tail(&cold->tail, &gz->tail);
+
+    pthread_mutex_unlock(&cold->cache_lock);
+    pthread_setcancelstate(cancelstate, NULL);
+
+    /* a replay behind the tail member compresses its own */
+    if (zlen < 0) {
+        size_t rawlen = bytes - start;
+        char *raw = malloc(rawlen > 0 ? rawlen : 1);
+        FILE *file = coldstore_fopen(cold, cold->filename);
+        bool complete = raw != NULL && file != NULL && fseeko(file, start, SEEK_SET) == 0 && fread(raw, 1, rawlen, file) == rawlen;
+
+        if (file != NULL)
+            fclose(file);
+
+        /* an empty tail still makes a member, so an empty log is a valid stream */
+        zlen = complete ? gzip_compress(raw, rawlen, COLDSTORE_TAIL_LEVEL, &gz->tail) : -1;
+        free(raw);
+    }
+
+    /* a reset meanwhile leaves a tail that does not fit the members */
+    if (zlen < 0 || cold->generation != generation)
+        return -1;
+
+    gz->taillen = zlen;
+
+    return 0;
+}
+
+
+/*
+ * Read the stored members from the cold file, then the tail.
+ * Fails once the log was reset or cut short, the members are gone then.
+ **/
+static ssize_t gzip_reader_read(void *cookie, char *buf, size_t size) {
+    struct coldstore_gzip_t *gz = (struct coldstore_gzip_t *)cookie;
+    struct coldstore_t *cold = gz->cold;
+
+    if (gz->block >= gz->nblocks) {
+        size_t readlen = gz->taillen - gz->tailpos < size ? gz->taillen - gz->tailpos : size;
+
+        memcpy(buf, gz->tail + gz->tailpos, readlen);
+        gz->tailpos += readlen;
+
+        return readlen;
+    }
+
+    ssize_t result = -1;
+    int cancelstate;
+
+    /* cancellation in pread() would leave the lock held */
+    pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &cancelstate);
+    pthread_rwlock_rdlock(&cold->lock);
+
+    if (cold->generation == gz->generation) {
+        struct coldstore_block_t *block = &cold->blocks[gz->block];
+        size_t readlen = block->zlen - gz->blockpos < size ? block->zlen - gz->blockpos : size;
+
+        result = pread(cold->fd, buf, readlen, block->zoffset + gz->blockpos);
+
+        if (result > 0 && (gz->blockpos += result) == block->zlen) {
+            gz->block++;
+            gz->blockpos = 0;
+        }
+    }
+    else {
+        errno = ESTALE;
+    }
+
+    pthread_rwlock_unlock(&cold->lock);
+    pthread_setcancelstate(cancelstate, NULL);
+
+    return result > 0 ? result : -1;
+}
+
+
+/*
+ * Open a compressed replay prepared by coldstore_gzip_prepare() for reading,
+ * it yields exactly gz->zbytes + gz->taillen bytes or fails.
+ * The stream must be closed before coldstore_gzip_free().
+ * Return the stream or NULL on error.
+ **/
+FILE *coldstore_gzip_fopen(struct coldstore_t *cold, struct coldstore_gzip_t *gz) {
+    gz->cold = cold;
+    gz->block = 0;
+    gz->blockpos = 0;
+    gz->tailpos = 0;
+
+    cookie_io_functions_t functions = {
+        .read = gzip_reader_read,
+    };
+
+    return fopencookie(gz, "r", functions);
+}
+
+
+void coldstore_gzip_free(struct coldstore_gzip_t *gz) {
+    free(gz->tail);
+    gz->tail = NULL;
+}
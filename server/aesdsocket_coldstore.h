@@ -0,0 +1,129 @@
+#ifndef AESDSOCKET_COLDSTORE_H
+#define AESDSOCKET_COLDSTORE_H
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <sys/types.h>
+#include <zlib.h>
+
+#include "aesdsocket_datalog.h"
+
+/*
+ * Compressed storage of the cold part of the data file.
+ * A background thread compresses full segments that can no longer change
+ * into datafile.cold, one gzip member per segment, and punches them out
+ * of the data file. Offsets in the data file stay valid, readers opened
+ * with coldstore_fopen() inflate cold segments transparently.
+ * Concatenated members form a valid gzip stream, so compressed replays
+ * send them as they are and only compress the hot tail. The tail member
+ * is kept open and sync flushed, later replays extend it by what was
+ * appended since and only finish a copy of it.
+ *
+ * datafile.cold: header | gzip member, repeated for consecutive segments
+ **/
+#define COLDSTORE_MAGIC 0x41455343
+#define COLDSTORE_SEGMENT_SIZE (1024 * 1024)
+#define COLDSTORE_INTERVAL_MS 1000 /* between looks for new cold segments */
+#define COLDSTORE_TAIL_LEVEL 1     /* the tail is compressed per replay, be quick */
+#define COLDSTORE_READ_CHUNK (16 * 1024) /* compressed bytes read at once */
+
+struct coldstore_header_t {
+    uint32_t magic;
+    uint32_t zlen;   /* length of the gzip member */
+    uint64_t offset; /* in the data file */
+    uint32_t rawlen;
+    uint32_t crc;    /* of the gzip member */
+};
+
+struct coldstore_block_t {
+    size_t offset;
+    size_t rawlen;
+    off_t zoffset; /* of the gzip member in the cold file */
+    size_t zlen;
+};
+
+/*
+ * Open gzip member of the hot tail from `start`, all input up to `end`
+ * is sync flushed into `data`, so finishing a copy of the stream
+ * completes the member for a replay up to `end`.
+ **/
+struct coldstore_tail_t {
+    z_stream zs;
+    bool active;
+    unsigned generation;
+    size_t start;
+    size_t end;
+    char *data;
+    size_t len;
+    size_t capacity;
+};
+
+struct coldstore_t {
+    const char *filename;
+    char *coldname;
+    int fd;     /* cold file */
+    int datafd; /* data file, for reading segments and punching holes */
+    pthread_rwlock_t lock; /* readers against moving segments */
+    struct coldstore_block_t *blocks;
+    size_t nblocks;
+    size_t capacity;
+    size_t bytes;     /* data file prefix held in blocks */
+    off_t end;        /* end of the valid blocks in the cold file */
+    atomic_uint generation; /* bumped on reset, stale segments are discarded */
+    pthread_mutex_t cache_lock;
+    struct coldstore_tail_t tail;
+    struct datalog_t *datalog;
+    pthread_t compactor_id;
+    bool running;
+    atomic_bool stopping;
+    pthread_mutex_t wake_lock;
+    pthread_cond_t wake;
+};
+
+/*
+ * A compressed replay prepared by coldstore_gzip_prepare()
+ **/
+struct coldstore_gzip_t {
+    size_t nblocks; /* stored members to send first */
+    size_t zbytes;  /* their total length */
+    char *tail;
+    size_t taillen;
+    unsigned generation; /* of the members, a reset invalidates them */
+    struct coldstore_t *cold; /* read position, see coldstore_gzip_fopen() */
+    size_t block;
+    size_t blockpos;
+    size_t tailpos;
+};
+
+int coldstore_open(struct coldstore_t *cold, const char *filename, bool held);
+
+int coldstore_reload(struct coldstore_t *cold);
+
+void coldstore_truncate(struct coldstore_t *cold, size_t bytes);
+
+int coldstore_reset(struct coldstore_t *cold);
+
+void coldstore_close(struct coldstore_t *cold);
+
+void coldstore_remove(struct coldstore_t *cold);
+
+int coldstore_start(struct coldstore_t *cold, struct datalog_t *datalog);
+
+void coldstore_stop(struct coldstore_t *cold);
+
+FILE *coldstore_fopen(struct coldstore_t *cold, const char *filename);
+
+int coldstore_gzip_prepare(struct coldstore_t *cold, size_t bytes, struct coldstore_gzip_t *gz);
+
+FILE *coldstore_gzip_fopen(struct coldstore_t *cold, struct coldstore_gzip_t *gz);
+
+void coldstore_gzip_free(struct coldstore_gzip_t *gz);
+
+#endif//AESDSOCKET_COLDSTORE_H
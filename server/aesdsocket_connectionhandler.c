@@ -1,21 +1,46 @@
 #include "aesdsocket_connectionhandler.h"
 
+#include <errno.h>
+#include <poll.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <sys/socket.h>
 #include <sys/types.h>
-#include <syslog.h>
 
+#include "aesdsocket_asynclog.h"
+#include "aesdsocket_binproto.h"
+#include "aesdsocket_coldstore.h"
+#include "aesdsocket_replication.h"
+#include "aesdsocket_shardstore.h"
 
-extern const char *tmpfilename;
 
+extern volatile bool _doexit;
 
-struct connection_handler_args_t *connection_handler_create_args(int socket_id, char *client_ip, pthread_mutex_t *tmpfile_lock) {
+
+/*
+ * Packet that turns a connection into a subscription of all future appends
+ **/
+static const char *subscribe_command = "AESDSOCKET_SUBSCRIBE\n";
+
+/*
+ * Packet answered with a single status line instead of a replay
+ **/
+static const char *status_command = "AESDSOCKET_STATUS\n";
+
+#define SUBSCRIPTION_BUFFER_SIZE (16 * 1024)
+#define SUBSCRIPTION_POLL_MS 1000
+
+
+struct connection_handler_args_t *connection_handler_create_args(int socket_id, char *client_ip, struct datalog_t *datalog, struct fairshare_t *fairshare, bool read_only, struct replication_follower_t *follower) {
     struct connection_handler_args_t *args = malloc(sizeof(struct connection_handler_args_t));
 
     args->socket_id = socket_id;
     args->client_ip = client_ip;
-    args->tmpfile_lock = tmpfile_lock;
+    args->datalog = datalog;
+    args->fairshare = fairshare;
+    args->read_only = read_only;
+    args->follower = follower;
 
     return args;
 }
@@ -34,8 +59,9 @@ void connection_handler_destroy_args(struct connection_handler_args_t **args) {
 struct connection_handler_res {
     FILE *socket;
     FILE *tmpfile;
-    pthread_mutex_t *tmpfile_lock;
+    char *packet;
     char *client_ip;
+    struct fairshare_client_t *client;
 };
 
 
@@ -47,30 +73,124 @@ static void destroy_connection_handler_res(void *args) {
 
     if (res->socket) fclose(res->socket);
     if (res->tmpfile) fclose(res->tmpfile);
-    if (res->tmpfile_lock) pthread_mutex_unlock(res->tmpfile_lock);
+    if (res->packet) free(res->packet);
     if (res->client_ip) free(res->client_ip);
+    if (res->client) fairshare_detach(res->client);
 }
 
 
-/* 
- * Copy line from instream to outstream.
- * Return number of bytes copied or -1 on error.
+/*
+ * Send appends to a subscriber, waiting for a slow one to take them.
+ * The ring goes on meanwhile, under the disconnect policy a subscriber
+ * it laps while waiting is given up instead of blocking on it forever.
+ * Return 0 on success, 1 if the subscriber lagged or -1 on error.
  **/
-static ssize_t transfer_line(FILE *instream, FILE *outstream) {
-    char *buffer = NULL;
-    size_t buflen = 0;
-    ssize_t result;
+static int send_to_subscriber(int sock, struct datalog_t *datalog, size_t cursor, const char *buffer, size_t len) {
+    struct pollfd pfd = { .fd = sock, .events = POLLOUT };
+
+    while (len > 0 && !_doexit) {
+        int ready = poll(&pfd, 1, SUBSCRIPTION_POLL_MS);
+
+        if (ready < 0 && errno != EINTR)
+            return -1;
+
+        if (ready <= 0) {
+            if (datalog->ring.policy == BROADCAST_DISCONNECT && datalog_lagging(datalog, cursor))
+                return 1;
 
-    result = getline(&buffer, &buflen, instream);
+            continue;
+        }
 
-    if (result > 0) {
-        fputs(buffer, outstream);
-        fflush(outstream);
+        ssize_t sent = send(sock, buffer, len, MSG_NOSIGNAL|MSG_DONTWAIT);
+
+        if (sent < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+                continue;
+
+            return -1;
+        }
+
+        buffer += sent;
+        len -= sent;
     }
 
-    free(buffer);
+    return len > 0 ? -1 : 0;
+}
+
+
+/*
+ * Push every new append to the client until it disconnects or lags behind.
+ * Return number of bytes sent.
+ **/
+static size_t serve_subscription(struct connection_handler_res *res, struct datalog_t *datalog) {
+    char buffer[SUBSCRIPTION_BUFFER_SIZE];
+    int sock = fileno(res->socket);
+    size_t cursor = datalog_subscribe(datalog);
+    size_t dropped = 0, transsum = 0;
+
+    asynclog_conn(res->client_ip, LOG_INFO, "Subscribed %s", res->client_ip);
+
+    while (!_doexit) {
+        size_t prev_dropped = dropped;
+        ssize_t len = datalog_tail(datalog, &cursor, buffer, sizeof(buffer), SUBSCRIPTION_POLL_MS, &dropped);
+
+        if (len < 0) {
+            asynclog_conn(res->client_ip, LOG_INFO, "Subscriber %s lagged behind, disconnecting", res->client_ip);
+            break;
+        }
+
+        if (dropped != prev_dropped) {
+            asynclog_conn(res->client_ip, LOG_INFO, "Subscriber %s lagged behind, dropped %zu bytes", res->client_ip, dropped - prev_dropped);
+        }
+
+        if (len == 0) {
+            /* idle, discard client input and notice hangups */
+            ssize_t received = recv(sock, buffer, sizeof(buffer), MSG_DONTWAIT);
+
+            if (received == 0 || (received < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR))
+                break;
+
+            continue;
+        }
+
+        int sent = send_to_subscriber(sock, datalog, cursor, buffer, len);
+
+        if (sent > 0)
+            asynclog_conn(res->client_ip, LOG_INFO, "Subscriber %s lagged behind, disconnecting", res->client_ip);
+
+        if (sent != 0)
+            break;
+
+        transsum += len;
+    }
 
-    return result;
+    return transsum;
+}
+
+
+/*
+ * Send the log counters and, on followers, the replication state as a
+ * single line of `key=value` pairs.
+ * Return number of bytes sent or -1 on error.
+ **/
+static ssize_t serve_status(struct connection_handler_res *res, struct datalog_t *datalog, struct replication_follower_t *follower) {
+    struct datalog_pos_t pos = datalog_position(datalog);
+    char status[256];
+
+    int len = snprintf(status, sizeof(status), "bytes=%zu records=%zu", pos.bytes, pos.records);
+
+    if (follower != NULL && len < (int)sizeof(status) - 1) {
+        status[len++] = ' ';
+        len += replication_follower_status(follower, status + len, sizeof(status) - len);
+    }
+
+    if (len >= (int)sizeof(status))
+        len = sizeof(status) - 1;
+
+    if (fprintf(res->socket, "%.*s\n", len, status) < 0 || fflush(res->socket) != 0)
+        return -1;
+
+    return len + 1;
 }
 
 
@@ -81,61 +201,110 @@ void *connection_handler(void *connection_handler_args) {
     struct connection_handler_args_t *args = (struct connection_handler_args_t *)connection_handler_args;
 
     struct connection_handler_res res = { 0 };
-    res.tmpfile_lock = args->tmpfile_lock;
     res.client_ip = args->client_ip;
 
+    struct datalog_t *datalog = args->datalog;
+    struct replication_follower_t *follower = args->follower;
+    bool read_only = args->read_only;
+
     pthread_cleanup_push(destroy_connection_handler_res, &res);
     
     res.socket = fdopen(args->socket_id, "a+");
+    res.client = fairshare_attach(args->fairshare, res.client_ip);
 
     free(args); args = NULL;
 
-    if (res.socket == NULL) {
+    if (res.socket == NULL || res.client == NULL) {
         pthread_exit(NULL);
     }
 
-    pthread_mutex_lock(res.tmpfile_lock);
-    res.tmpfile = fopen(tmpfilename, "a");
+    setlinebuf(res.socket);
 
-    if (res.tmpfile == NULL) {
+    /* binary clients announce themselves with a magic first byte */
+    int firstbyte = fgetc(res.socket);
+
+    if (firstbyte == BINPROTO_MAGIC) {
+        ssize_t transsum = binproto_serve(res.socket, datalog, res.client, read_only, res.client_ip);
+
+        if (transsum < 0) {
+            asynclog_conn(res.client_ip, LOG_ERR, "Error in binary session with %s", res.client_ip);
+        }
+        else {
+            asynclog_conn(res.client_ip, LOG_DEBUG, "Sent %ld bytes to %s", transsum, res.client_ip);
+        }
+
+        asynclog_conn(res.client_ip, LOG_INFO, "Closed connection from %s", res.client_ip);
         pthread_exit(NULL);
     }
+    else if (firstbyte != EOF) {
+        ungetc(firstbyte, res.socket);
+    }
 
-    setlinebuf(res.tmpfile);
-    setlinebuf(res.socket);
-
-    ssize_t transres = transfer_line(res.socket, res.tmpfile);
+    /* receive the packet before taking the log lock, slow clients must not block others */
+    size_t packetlen = 0;
+    ssize_t transres = getline(&res.packet, &packetlen, res.socket);
 
-    res.tmpfile = freopen(tmpfilename, "r", res.tmpfile);
-    pthread_mutex_unlock(res.tmpfile_lock);
-    
     if (transres == -1) {
-        syslog(LOG_PERROR, "Error receiving from %s", res.client_ip);
+        asynclog_conn(res.client_ip, LOG_ERR, "Error receiving from %s", res.client_ip);
         pthread_exit(NULL);
     }
     else {
-        syslog(LOG_DEBUG, "Received %ld bytes from %s", transres, res.client_ip);
+        asynclog_conn(res.client_ip, LOG_DEBUG, "Received %ld bytes from %s", transres, res.client_ip);
     }
 
-    if (res.tmpfile == NULL) {
+    if (strcmp(res.packet, subscribe_command) == 0) {
+        if (datalog->shards != NULL) {
+            asynclog_conn(res.client_ip, LOG_ERR, "Subscriptions are not supported with sharded storage, closing %s", res.client_ip);
+            pthread_exit(NULL);
+        }
+
+        ssize_t transsum = serve_subscription(&res, datalog);
+        asynclog_conn(res.client_ip, LOG_DEBUG, "Sent %ld bytes to subscriber %s", transsum, res.client_ip);
+        asynclog_conn(res.client_ip, LOG_INFO, "Closed connection from %s", res.client_ip);
+        pthread_exit(NULL);
+    }
+    else if (strcmp(res.packet, status_command) == 0) {
+        if (serve_status(&res, datalog, follower) < 0)
+            asynclog_conn(res.client_ip, LOG_ERR, "Error sending status to %s", res.client_ip);
+
+        asynclog_conn(res.client_ip, LOG_INFO, "Closed connection from %s", res.client_ip);
         pthread_exit(NULL);
     }
+    else if (read_only) {
+        asynclog_conn(res.client_ip, LOG_DEBUG, "Read-only replica, discarding packet from %s", res.client_ip);
+    }
+    else {
+        /* wait for our turn, heavy clients must not crowd out the others,
+         * but not while a handoff holds appends back, the slot would idle */
+        datalog_wait_released(datalog);
+        fairshare_acquire(res.client, FAIRSHARE_APPEND);
+        ssize_t appended = datalog_append(datalog, res.packet, transres);
+        fairshare_release(res.client, FAIRSHARE_APPEND, appended > 0 ? appended : 0);
+
+        if (appended == -1) {
+            pthread_exit(NULL);
+        }
+    }
 
-    setlinebuf(res.tmpfile);
+    if (datalog->shards != NULL)
+        res.tmpfile = shardstore_fopen(datalog->shards, NULL, false);
+    else
+        res.tmpfile = coldstore_fopen(datalog->cold, datalog->filename);
 
-    ssize_t transsum = 0;
-    while ((transres = transfer_line(res.tmpfile, res.socket)) > 0) {
-        transsum += transres;
+    if (res.tmpfile == NULL) {
+        pthread_exit(NULL);
     }
 
+    ssize_t transsum = fairshare_replay(res.client, res.tmpfile, res.socket);
+
     if (transsum > 0) {
-        syslog(LOG_DEBUG, "Sent %ld bytes to %s", transsum, res.client_ip);
+        asynclog_conn(res.client_ip, LOG_DEBUG, "Sent %ld bytes to %s", transsum, res.client_ip);
     }
     else {
-        syslog(LOG_PERROR, "Error sending to %s", res.client_ip);
+        asynclog_conn(res.client_ip, LOG_ERR, "Error sending to %s", res.client_ip);
     }
 
-    syslog(LOG_INFO, "Closed connection from %s", res.client_ip);
+    asynclog_conn(res.client_ip, LOG_INFO, "Closed connection from %s", res.client_ip);
 
     pthread_cleanup_pop(1);
 
@@ -6,6 +6,12 @@
 #endif
 
 #include <pthread.h>
+#include <stdbool.h>
+
+#include "aesdsocket_datalog.h"
+#include "aesdsocket_fairshare.h"
+
+struct replication_follower_t;
 
 /*
  * Param struct for connection handler threads
@@ -13,10 +19,13 @@
 struct connection_handler_args_t {
     int socket_id;
     char *client_ip;
-    pthread_mutex_t *tmpfile_lock;
+    struct datalog_t *datalog;
+    struct fairshare_t *fairshare;
+    bool read_only; /* replay only, used by replication followers */
+    struct replication_follower_t *follower; /* reported in status queries, if set */
 };
 
-struct connection_handler_args_t *connection_handler_create_args(int socket_id, char *client_ip, pthread_mutex_t *tmpfile_lock);
+struct connection_handler_args_t *connection_handler_create_args(int socket_id, char *client_ip, struct datalog_t *datalog, struct fairshare_t *fairshare, bool read_only, struct replication_follower_t *follower);
 
 void connection_handler_destroy_args(struct connection_handler_args_t **args);
 
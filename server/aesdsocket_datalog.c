@@ -0,0 +1,637 @@
+#include "aesdsocket_datalog.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/uio.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "aesdsocket_asynclog.h"
+#include "aesdsocket_coldstore.h"
+#include "aesdsocket_persist.h"
+#include "aesdsocket_shardstore.h"
+
+
+/*
+ * Records queued for the writer thread, lives on the producer's stack.
+ **/
+struct datalog_request_t {
+    struct mpsc_node_t node; /* first member, requests are cast from nodes */
+    const struct iovec *records;
+    int count;               /* at most DATALOG_WRITER_BATCH */
+    size_t bytes;
+    ssize_t result;
+    sem_t done;
+};
+
+
+static void *datalog_writer(void *datalog);
+
+
+/*
+ * Compute an absolute CLOCK_MONOTONIC deadline for timed waits.
+ **/
+static struct timespec deadline_after(int timeout_ms) {
+    struct timespec deadline;
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    deadline.tv_sec += timeout_ms / 1000;
+    deadline.tv_nsec += (timeout_ms % 1000) * 1000000L;
+
+    if (deadline.tv_nsec >= 1000000000L) {
+        deadline.tv_sec += 1;
+        deadline.tv_nsec -= 1000000000L;
+    }
+
+    return deadline;
+}
+
+
+/*
+ * Initialize the log, picking up the counters of an existing data file
+ * from its record index, see aesdsocket_persist.h.
+ * With `durable` set the index is checkpointed, so recovery only has to
+ * verify the records after the last checkpoint.
+ * With `shards` set appends bypass the data file and its writer thread.
+ * With `cold` set full segments are compressed in the background.
+ * The writer uses `fd` if it is an open data file, e.g. from a hot restart.
+ * With `held` set another process still appends to the same files, e.g.
+ * during a hot restart. Recovery would cut off its unindexed appends, so
+ * it is left to datalog_release() and appends and counter reads block
+ * until then. Call datalog_release() once the other process is done.
+ * Return 0 on success or -1 on error.
+ **/
+int datalog_init(struct datalog_t *datalog, const char *filename, int fd, struct shardstore_t *shards, struct coldstore_t *cold, bool durable, bool held) {
+    memset(datalog, 0, sizeof(struct datalog_t));
+    datalog->filename = filename;
+    datalog->fd = -1;
+    datalog->shards = shards;
+    datalog->cold = cold;
+
+    if (shards == NULL) {
+        datalog->persist = calloc(1, sizeof(struct persist_t));
+
+        if (datalog->persist == NULL) {
+            return -1;
+        }
+
+        /* kept for datalog_release() */
+        datalog->persist->durable = durable;
+    }
+
+    /* a held log picks up its counters in datalog_release() */
+    if (!held && datalog->persist != NULL) {
+        struct datalog_pos_t pos = { 0 };
+
+        if (persist_open(datalog->persist, filename, cold, durable, &pos) != 0) {
+            return -1;
+        }
+
+        datalog->bytes = pos.bytes;
+        datalog->records = pos.records;
+    }
+
+    if (!held && cold != NULL) {
+        coldstore_truncate(cold, datalog->bytes);
+    }
+
+    if (broadcast_ring_init(&datalog->ring, DATALOG_RING_SIZE, BROADCAST_DROP) != 0) {
+        return -1;
+    }
+
+    pthread_condattr_t condattr;
+    pthread_condattr_init(&condattr);
+    pthread_condattr_setclock(&condattr, CLOCK_MONOTONIC);
+
+    pthread_mutex_init(&datalog->lock, NULL);
+    pthread_mutex_init(&datalog->checkpoint_lock, NULL);
+    pthread_cond_init(&datalog->appended, &condattr);
+    pthread_cond_init(&datalog->released, NULL);
+    atomic_init(&datalog->held, held);
+    atomic_init(&datalog->failed, false);
+
+    pthread_condattr_destroy(&condattr);
+
+    if (shards != NULL) {
+        return 0;
+    }
+
+    datalog->fd = fd >= 0 ? fd : open(filename, O_WRONLY|O_CREAT|O_APPEND, 0644);
+
+    if (datalog->fd < 0) {
+        return -1;
+    }
+
+    mpsc_queue_init(&datalog->queue);
+    sem_init(&datalog->pending, 0, 0);
+    atomic_init(&datalog->stopping, false);
+
+    if (pthread_create(&datalog->writer_id, NULL, datalog_writer, datalog) != 0) {
+        close(datalog->fd);
+        datalog->fd = -1;
+        return -1;
+    }
+
+    if (cold != NULL && coldstore_start(cold, datalog) != 0) {
+        return -1;
+    }
+
+    return 0;
+}
+
+
+/*
+ * Stop the writer after draining all queued appends and free resources.
+ **/
+void datalog_destroy(struct datalog_t *datalog) {
+    if (datalog->cold != NULL) {
+        coldstore_stop(datalog->cold);
+    }
+
+    if (datalog->fd >= 0) {
+        atomic_store(&datalog->stopping, true);
+        sem_post(&datalog->pending);
+        pthread_join(datalog->writer_id, NULL);
+
+        sem_destroy(&datalog->pending);
+        close(datalog->fd);
+    }
+
+    /* a log never released never opened its index */
+    if (datalog->persist != NULL) {
+        if (!atomic_load(&datalog->held))
+            persist_close(datalog->persist, (struct datalog_pos_t){ datalog->bytes, datalog->records });
+
+        free(datalog->persist);
+    }
+
+    broadcast_ring_destroy(&datalog->ring);
+    pthread_cond_destroy(&datalog->released);
+    pthread_cond_destroy(&datalog->appended);
+    pthread_mutex_destroy(&datalog->checkpoint_lock);
+    pthread_mutex_destroy(&datalog->lock);
+}
+
+
+/*
+ * Block until the log is released, see datalog_init().
+ * Callers that queue for shared resources before appending should wait
+ * here first, appends would hold them until the release.
+ **/
+void datalog_wait_released(struct datalog_t *datalog) {
+    if (!atomic_load(&datalog->held))
+        return;
+
+    int cancelstate;
+
+    pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &cancelstate);
+    pthread_mutex_lock(&datalog->lock);
+
+    while (atomic_load(&datalog->held))
+        pthread_cond_wait(&datalog->released, &datalog->lock);
+
+    pthread_mutex_unlock(&datalog->lock);
+    pthread_setcancelstate(cancelstate, NULL);
+}
+
+
+/*
+ * Recover everything the other process appended and resume,
+ * for a log initialized as held. Call once the other process is done.
+ * Return 0 on success or -1 if the counters could not be recovered.
+ **/
+int datalog_release(struct datalog_t *datalog) {
+    int result;
+
+    pthread_mutex_lock(&datalog->lock);
+
+    if (datalog->cold != NULL && coldstore_reload(datalog->cold) != 0) {
+        asynclog_write(LOG_ERR, "Error reloading cold segments");
+    }
+
+    if (datalog->shards != NULL) {
+        result = shardstore_rescan(datalog->shards);
+    }
+    else {
+        struct datalog_pos_t pos = { 0 };
+        result = persist_open(datalog->persist, datalog->filename, datalog->cold, datalog->persist->durable, &pos);
+        datalog->bytes = pos.bytes;
+        datalog->records = pos.records;
+    }
+
+    if (datalog->cold != NULL) {
+        coldstore_truncate(datalog->cold, datalog->bytes);
+    }
+
+    atomic_store(&datalog->held, false);
+    pthread_cond_broadcast(&datalog->released);
+
+    pthread_mutex_unlock(&datalog->lock);
+
+    return result;
+}
+
+
+/*
+ * Checkpoint a durable index once enough records were indexed since the last.
+ * The syncs run outside the log lock, appends go on meanwhile.
+ * Called by the writer thread only.
+ **/
+static void checkpoint_if_due(struct datalog_t *datalog) {
+    struct persist_t *persist = datalog->persist;
+    struct persist_checkpoint_t checkpoint;
+    bool due;
+
+    if (persist == NULL || !persist->durable)
+        return;
+
+    /* a reset meanwhile would leave the checkpoint pointing into dropped data */
+    pthread_mutex_lock(&datalog->checkpoint_lock);
+    pthread_mutex_lock(&datalog->lock);
+
+    due = persist->entries - persist->checkpoint_entries >= PERSIST_CHECKPOINT_INTERVAL;
+
+    if (due)
+        persist_checkpoint_begin(persist, (struct datalog_pos_t){ datalog->bytes, datalog->records }, &checkpoint);
+
+    pthread_mutex_unlock(&datalog->lock);
+
+    if (due && persist_checkpoint_write(persist, &checkpoint) == 0) {
+        pthread_mutex_lock(&datalog->lock);
+        persist_checkpoint_end(persist, &checkpoint);
+        pthread_mutex_unlock(&datalog->lock);
+    }
+    else if (due) {
+        asynclog_write(LOG_ERR, "Error writing checkpoint");
+    }
+
+    pthread_mutex_unlock(&datalog->checkpoint_lock);
+}
+
+
+/*
+ * Write all buffers, resuming after partial writes.
+ * Return number of bytes written, short only on error.
+ **/
+static size_t writev_all(int fd, struct iovec *iov, int iovcnt) {
+    size_t total = 0;
+
+    while (iovcnt > 0) {
+        ssize_t written = writev(fd, iov, iovcnt);
+
+        if (written < 0) {
+            if (errno == EINTR)
+                continue;
+
+            break;
+        }
+
+        total += written;
+
+        while (iovcnt > 0 && (size_t)written >= iov->iov_len) {
+            written -= iov->iov_len;
+            ++iov;
+            --iovcnt;
+        }
+
+        if (iovcnt > 0) {
+            iov->iov_base = (char *)iov->iov_base + written;
+            iov->iov_len -= written;
+        }
+    }
+
+    return total;
+}
+
+
+/*
+ * Publish a written batch to readers and complete its requests.
+ * `iov` holds the records of all requests in order. After a short write
+ * only the requests written completely count, the torn rest is cut off
+ * again, so the file always ends in a whole record.
+ **/
+static void commit_batch(struct datalog_t *datalog, struct datalog_request_t **batch, int count, const struct iovec *iov, size_t written) {
+    int complete = 0, indexed = 0;
+    size_t completebytes = 0;
+
+    while (complete < count && completebytes + batch[complete]->bytes <= written) {
+        completebytes += batch[complete]->bytes;
+        indexed += batch[complete]->count;
+        ++complete;
+    }
+
+    pthread_mutex_lock(&datalog->lock);
+
+    size_t offset = datalog->bytes;
+
+    if (written > completebytes && ftruncate(datalog->fd, offset + completebytes) != 0) {
+        asynclog_write(LOG_ERR, "Error cutting off torn append to %s, refusing appends", datalog->filename);
+        atomic_store(&datalog->failed, true);
+    }
+
+    for (int i = 0; i < complete; ++i) {
+        struct datalog_request_t *request = batch[i];
+
+        for (int r = 0; r < request->count; ++r)
+            broadcast_ring_push(&datalog->ring, request->records[r].iov_base, request->records[r].iov_len);
+
+        request->result = request->bytes;
+    }
+
+    datalog->bytes += completebytes;
+    datalog->records += indexed;
+
+    if (datalog->persist != NULL && indexed > 0 && persist_record(datalog->persist, offset, iov, indexed) != 0) {
+        asynclog_write(LOG_ERR, "Error indexing %d records at offset %zu, lost on recovery", indexed, offset);
+
+        for (int i = 0; i < complete; ++i)
+            batch[i]->result = -1;
+    }
+
+    pthread_cond_broadcast(&datalog->appended);
+    pthread_mutex_unlock(&datalog->lock);
+
+    /* requests belong to their producers again after this */
+    for (int i = 0; i < count; ++i)
+        sem_post(&batch[i]->done);
+}
+
+
+/*
+ * Writer thread, drains the append queue into few large writes
+ **/
+static void *datalog_writer(void *datalog_ptr) {
+    struct datalog_t *datalog = (struct datalog_t *)datalog_ptr;
+    struct datalog_request_t *batch[DATALOG_WRITER_BATCH];
+    struct datalog_request_t *carry = NULL; /* popped, but did not fit the last batch */
+    struct iovec iov[DATALOG_WRITER_BATCH], iovcopy[DATALOG_WRITER_BATCH];
+
+    for (;;) {
+        if (carry == NULL) {
+            while (sem_wait(&datalog->pending) != 0 && errno == EINTR)
+                ;
+        }
+
+        int count = 0, iovcnt = 0;
+
+        while (count < DATALOG_WRITER_BATCH) {
+            struct datalog_request_t *request = carry;
+
+            if (request == NULL) {
+                struct mpsc_node_t *node = mpsc_queue_pop(&datalog->queue);
+
+                if (node == NULL)
+                    break;
+
+                request = (struct datalog_request_t *)node;
+            }
+
+            /* requests hold at most a full batch, so every one fits an empty batch */
+            if (iovcnt + request->count > DATALOG_WRITER_BATCH) {
+                carry = request;
+                break;
+            }
+
+            carry = NULL;
+            memcpy(iov + iovcnt, request->records, request->count * sizeof(struct iovec));
+            iovcnt += request->count;
+            batch[count++] = request;
+        }
+
+        if (count == 0) {
+            /* producers are gone when stopping, an empty queue stays empty */
+            if (atomic_load(&datalog->stopping))
+                break;
+
+            continue;
+        }
+
+        /* the file may end in torn bytes, appends behind them would be lost on recovery */
+        size_t written = 0;
+
+        if (!atomic_load(&datalog->failed)) {
+            memcpy(iovcopy, iov, iovcnt * sizeof(struct iovec));
+            written = writev_all(datalog->fd, iovcopy, iovcnt);
+        }
+
+        commit_batch(datalog, batch, count, iov, written);
+        checkpoint_if_due(datalog);
+    }
+
+    return NULL;
+}
+
+
+/*
+ * Queue up to DATALOG_WRITER_BATCH records and wait until they are written.
+ * Return number of bytes written or -1 on error.
+ **/
+static ssize_t queue_records(struct datalog_t *datalog, const struct iovec *records, int count) {
+    struct datalog_request_t request = { .records = records, .count = count, .result = -1 };
+
+    for (int i = 0; i < count; ++i)
+        request.bytes += records[i].iov_len;
+
+    sem_init(&request.done, 0, 0);
+
+    mpsc_queue_push(&datalog->queue, &request.node);
+    sem_post(&datalog->pending);
+
+    while (sem_wait(&request.done) != 0 && errno == EINTR)
+        ;
+
+    sem_destroy(&request.done);
+
+    return request.result;
+}
+
+
+/*
+ * Append records to the log and wait until they are written.
+ * Each record keeps its own index entry, so binary replays can frame it.
+ * Return number of bytes written or -1 on error.
+ **/
+ssize_t datalog_append_records(struct datalog_t *datalog, const struct iovec *records, int count) {
+    int cancelstate;
+    ssize_t result = 0;
+
+    /* the request lives on this stack until the writer is done with it */
+    pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &cancelstate);
+
+    datalog_wait_released(datalog);
+
+    for (int i = 0; i < count && result >= 0; ) {
+        int chunk = count - i < DATALOG_WRITER_BATCH ? count - i : DATALOG_WRITER_BATCH;
+        ssize_t written = 0;
+
+        /* shards have their own locks, the writer thread would serialize them again */
+        if (datalog->shards != NULL) {
+            for (int r = i; r < i + chunk && written >= 0; ++r) {
+                ssize_t len = shardstore_append(datalog->shards, records[r].iov_base, records[r].iov_len);
+                written = len < 0 ? -1 : written + len;
+            }
+        }
+        else {
+            written = queue_records(datalog, records + i, chunk);
+        }
+
+        result = written < 0 ? -1 : result + written;
+        i += chunk;
+    }
+
+    pthread_setcancelstate(cancelstate, NULL);
+
+    return result;
+}
+
+
+/*
+ * Append a single record to the log and wait until it is written.
+ * Return number of bytes written or -1 on error.
+ **/
+ssize_t datalog_append(struct datalog_t *datalog, const char *buffer, size_t buflen) {
+    struct iovec record = { .iov_base = (void *)buffer, .iov_len = buflen };
+
+    return datalog_append_records(datalog, &record, 1);
+}
+
+
+/*
+ * Drop all data, used when a follower diverged from its leader.
+ * A log that failed to cut off a torn append takes appends again after.
+ * Return 0 on success or -1 on error.
+ **/
+int datalog_reset(struct datalog_t *datalog) {
+    pthread_mutex_lock(&datalog->checkpoint_lock);
+    pthread_mutex_lock(&datalog->lock);
+
+    int result = truncate(datalog->filename, 0);
+
+    if (result == 0 && datalog->persist != NULL) {
+        result = persist_reset(datalog->persist);
+    }
+
+    if (result == 0 && datalog->cold != NULL) {
+        result = coldstore_reset(datalog->cold);
+    }
+
+    if (result == 0 || errno == ENOENT) {
+        datalog->bytes = 0;
+        datalog->records = 0;
+        atomic_store(&datalog->failed, false);
+        result = 0;
+    }
+
+    pthread_mutex_unlock(&datalog->lock);
+    pthread_mutex_unlock(&datalog->checkpoint_lock);
+
+    return result;
+}
+
+
+struct datalog_pos_t datalog_position(struct datalog_t *datalog) {
+    datalog_wait_released(datalog);
+
+    if (datalog->shards != NULL) {
+        struct shardstore_cut_t cut;
+        shardstore_snapshot(datalog->shards, &cut);
+        return (struct datalog_pos_t){ cut.bytes, cut.records };
+    }
+
+    pthread_mutex_lock(&datalog->lock);
+    struct datalog_pos_t pos = { datalog->bytes, datalog->records };
+    pthread_mutex_unlock(&datalog->lock);
+
+    return pos;
+}
+
+
+/*
+ * Wait until the log grows beyond `offset` or the timeout expires.
+ * Return the counters at wakeup.
+ **/
+struct datalog_pos_t datalog_wait(struct datalog_t *datalog, size_t offset, int timeout_ms) {
+    struct timespec deadline = deadline_after(timeout_ms);
+    int cancelstate;
+
+    /* cancellation inside the wait would leave the lock held */
+    pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &cancelstate);
+    pthread_mutex_lock(&datalog->lock);
+
+    while (datalog->bytes <= offset) {
+        if (pthread_cond_timedwait(&datalog->appended, &datalog->lock, &deadline) == ETIMEDOUT)
+            break;
+    }
+
+    struct datalog_pos_t pos = { datalog->bytes, datalog->records };
+
+    pthread_mutex_unlock(&datalog->lock);
+    pthread_setcancelstate(cancelstate, NULL);
+
+    return pos;
+}
+
+
+/*
+ * Return a subscriber cursor positioned at the next append.
+ **/
+size_t datalog_subscribe(struct datalog_t *datalog) {
+    pthread_mutex_lock(&datalog->lock);
+    size_t cursor = datalog->ring.head;
+    pthread_mutex_unlock(&datalog->lock);
+
+    return cursor;
+}
+
+
+/*
+ * Check whether appends beyond `cursor` were already overwritten in the ring.
+ **/
+bool datalog_lagging(struct datalog_t *datalog, size_t cursor) {
+    pthread_mutex_lock(&datalog->lock);
+    bool lagging = cursor < broadcast_ring_oldest(&datalog->ring);
+    pthread_mutex_unlock(&datalog->lock);
+
+    return lagging;
+}
+
+
+/*
+ * Wait for appends beyond `cursor` and copy them into buffer.
+ * Lagging cursors are resynced and the skipped bytes added to `dropped`,
+ * unless the ring policy is to disconnect them.
+ * Return number of bytes copied, 0 on timeout or -1 if the subscriber lagged.
+ **/
+ssize_t datalog_tail(struct datalog_t *datalog, size_t *cursor, char *buffer, size_t buflen, int timeout_ms, size_t *dropped) {
+    struct timespec deadline = deadline_after(timeout_ms);
+    ssize_t result = 0;
+    int cancelstate;
+
+    pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &cancelstate);
+    pthread_mutex_lock(&datalog->lock);
+
+    while (datalog->ring.head <= *cursor) {
+        if (pthread_cond_timedwait(&datalog->appended, &datalog->lock, &deadline) == ETIMEDOUT)
+            break;
+    }
+
+    if (*cursor < broadcast_ring_oldest(&datalog->ring)) {
+        if (datalog->ring.policy == BROADCAST_DISCONNECT) {
+            result = -1;
+        }
+        else {
+            *dropped += broadcast_ring_resync(&datalog->ring, cursor);
+        }
+    }
+
+    if (result == 0) {
+        result = broadcast_ring_read(&datalog->ring, cursor, buffer, buflen);
+    }
+
+    pthread_mutex_unlock(&datalog->lock);
+    pthread_setcancelstate(cancelstate, NULL);
+
+    return result;
+}
@@ -0,0 +1,84 @@
+#ifndef AESDSOCKET_DATALOG_H
+#define AESDSOCKET_DATALOG_H
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <pthread.h>
+#include <semaphore.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#include "aesdsocket_broadcast.h"
+#include "aesdsocket_mpsc.h"
+
+#define DATALOG_RING_SIZE (1024 * 1024)
+#define DATALOG_WRITER_BATCH 256 /* records coalesced into one writev() */
+
+struct shardstore_t;
+struct persist_t;
+struct coldstore_t;
+
+/*
+ * Append-only data log shared by all connections.
+ * Appends are queued to a single writer thread that owns the data file,
+ * counters are only valid while holding `lock`.
+ **/
+struct datalog_t {
+    const char *filename;
+    int fd;                  /* data file, written by the writer thread only */
+    pthread_t writer_id;
+    struct mpsc_queue_t queue; /* pending appends */
+    sem_t pending;             /* posted once per queued append */
+    atomic_bool stopping;
+    atomic_bool held;          /* see datalog_init() */
+    atomic_bool failed;        /* a torn append could not be cut off, see datalog_reset() */
+    pthread_cond_t released;
+    pthread_mutex_t lock;
+    pthread_cond_t appended; /* broadcast after every append */
+    pthread_mutex_t checkpoint_lock; /* taken before `lock`, resets wait for checkpoints */
+    size_t bytes;            /* current size of the data file */
+    size_t records;          /* number of records appended */
+    struct broadcast_ring_t ring; /* recent appends for subscribers */
+    struct shardstore_t *shards;  /* sharded storage instead of filename, if set */
+    struct persist_t *persist;    /* record index of filename, unless sharded */
+    struct coldstore_t *cold;     /* compressed cold segments, if set */
+};
+
+/*
+ * Snapshot of the log counters
+ **/
+struct datalog_pos_t {
+    size_t bytes;
+    size_t records;
+};
+
+int datalog_init(struct datalog_t *datalog, const char *filename, int fd, struct shardstore_t *shards, struct coldstore_t *cold, bool durable, bool held);
+
+void datalog_destroy(struct datalog_t *datalog);
+
+int datalog_release(struct datalog_t *datalog);
+
+void datalog_wait_released(struct datalog_t *datalog);
+
+ssize_t datalog_append(struct datalog_t *datalog, const char *buffer, size_t buflen);
+
+ssize_t datalog_append_records(struct datalog_t *datalog, const struct iovec *records, int count);
+
+int datalog_reset(struct datalog_t *datalog);
+
+struct datalog_pos_t datalog_position(struct datalog_t *datalog);
+
+struct datalog_pos_t datalog_wait(struct datalog_t *datalog, size_t offset, int timeout_ms);
+
+size_t datalog_subscribe(struct datalog_t *datalog);
+
+bool datalog_lagging(struct datalog_t *datalog, size_t cursor);
+
+ssize_t datalog_tail(struct datalog_t *datalog, size_t *cursor, char *buffer, size_t buflen, int timeout_ms, size_t *dropped);
+
+#endif//AESDSOCKET_DATALOG_H
@@ -0,0 +1,481 @@
+#include "aesdsocket_fairshare.h"
+
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "aesdsocket_asynclog.h"
+#include "aesdsocket_transfer.h"
+
+
+/*
+ * A request waiting for its turn, lives on the stack of the waiting thread
+ **/
+struct fairshare_waiter_t {
+    enum fairshare_kind_t kind;
+    bool granted;
+    bool throttled;
+    struct fairshare_waiter_t *next;
+};
+
+
+/*
+ * Context for cleaning up a waiter of a cancelled thread
+ **/
+struct fairshare_wait_t {
+    struct fairshare_client_t *client;
+    struct fairshare_waiter_t *waiter;
+};
+
+
+/*
+ * Replay chunk of a cancelled thread
+ **/
+struct fairshare_replay_res {
+    FILE *chunk;
+    char *chunkdata;
+};
+
+
+static const char *kind_names[FAIRSHARE_KINDS] = { "appends", "replays" };
+
+
+static unsigned hash_ip(const char *ip) {
+    unsigned hash = 2166136261u; /* FNV-1a */
+
+    while (*ip) {
+        hash ^= (unsigned char)*ip++;
+        hash *= 16777619u;
+    }
+
+    return hash % FAIRSHARE_BUCKETS;
+}
+
+
+static double elapsed_s(const struct timespec *from, const struct timespec *to) {
+    return (to->tv_sec - from->tv_sec) + (to->tv_nsec - from->tv_nsec) / 1e9;
+}
+
+
+/*
+ * Add the tokens earned since the last refill, saving up at most one second worth.
+ **/
+static void refill(struct fairshare_t *fairshare, struct fairshare_client_t *client, enum fairshare_kind_t kind, const struct timespec *now) {
+    struct fairshare_bucket_t *bucket = &client->buckets[kind];
+    size_t rate = fairshare->rates[kind];
+
+    if (rate > 0) {
+        bucket->tokens += rate * elapsed_s(&bucket->refilled, now);
+
+        if (bucket->tokens > rate)
+            bucket->tokens = rate;
+    }
+
+    bucket->refilled = *now;
+}
+
+
+static void ring_insert(struct fairshare_t *fairshare, struct fairshare_client_t *client) {
+    struct fairshare_client_t *cursor = fairshare->cursor;
+
+    if (cursor == NULL) {
+        client->prev = client->next = client;
+        fairshare->cursor = client;
+        return;
+    }
+
+    /* newcomers queue up behind everyone else in this round */
+    client->next = cursor;
+    client->prev = cursor->prev;
+    cursor->prev->next = client;
+    cursor->prev = client;
+}
+
+
+static void ring_remove(struct fairshare_t *fairshare, struct fairshare_client_t *client) {
+    if (client->next == client) {
+        fairshare->cursor = NULL;
+    }
+    else {
+        client->prev->next = client->next;
+        client->next->prev = client->prev;
+
+        if (fairshare->cursor == client)
+            fairshare->cursor = client->next;
+    }
+
+    client->prev = client->next = NULL;
+}
+
+
+static void enqueue(struct fairshare_t *fairshare, struct fairshare_client_t *client, struct fairshare_waiter_t *waiter) {
+    if (client->tail != NULL) {
+        client->tail->next = waiter;
+    }
+    else {
+        client->head = waiter;
+        ring_insert(fairshare, client);
+    }
+
+    client->tail = waiter;
+}
+
+
+/*
+ * Remove a waiter from its client's queue, wherever it is.
+ **/
+static void dequeue(struct fairshare_t *fairshare, struct fairshare_client_t *client, struct fairshare_waiter_t *waiter) {
+    struct fairshare_waiter_t **link = &client->head, *prev = NULL;
+
+    while (*link != NULL && *link != waiter) {
+        prev = *link;
+        link = &(*link)->next;
+    }
+
+    if (*link == NULL)
+        return;
+
+    *link = waiter->next;
+
+    if (client->tail == waiter)
+        client->tail = prev;
+
+    if (client->head == NULL)
+        ring_remove(fairshare, client);
+}
+
+
+/*
+ * Grant free slots to the heads of the client queues in round-robin order,
+ * skipping clients in debt. Call with the lock held.
+ * Return true if anything was granted.
+ **/
+static bool dispatch(struct fairshare_t *fairshare) {
+    struct timespec now;
+    bool granted = false;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    while (fairshare->slots > 0 && fairshare->cursor != NULL) {
+        struct fairshare_client_t *first = fairshare->cursor, *client = first;
+        bool found = false;
+
+        do {
+            struct fairshare_waiter_t *waiter = client->head;
+
+            refill(fairshare, client, waiter->kind, &now);
+
+            if (client->buckets[waiter->kind].tokens >= 0) {
+                struct fairshare_client_t *next = client->next;
+
+                dequeue(fairshare, client, waiter);
+                waiter->granted = true;
+                fairshare->slots--;
+
+                /* the next round starts behind the client served, throttled ones included */
+                if (fairshare->cursor != NULL)
+                    fairshare->cursor = next;
+
+                found = true;
+                break;
+            }
+
+            if (!waiter->throttled) {
+                waiter->throttled = true;
+                client->throttled[waiter->kind]++;
+                fairshare->throttled[waiter->kind]++;
+            }
+
+            client = client->next;
+        } while (client != first);
+
+        if (!found)
+            break;
+
+        granted = true;
+    }
+
+    return granted;
+}
+
+
+/*
+ * Time until the bucket is out of debt, capped at FAIRSHARE_POLL_MS.
+ **/
+static struct timespec wakeup_time(struct fairshare_t *fairshare, struct fairshare_client_t *client, enum fairshare_kind_t kind) {
+    struct timespec deadline;
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+
+    long wait_ns = FAIRSHARE_POLL_MS * 1000000L;
+    double tokens = client->buckets[kind].tokens;
+    size_t rate = fairshare->rates[kind];
+
+    if (rate > 0 && tokens < 0 && -tokens / rate * 1e9 < wait_ns)
+        wait_ns = -tokens / rate * 1e9 + 1000000L;
+
+    deadline.tv_nsec += wait_ns;
+
+    while (deadline.tv_nsec >= 1000000000L) {
+        deadline.tv_sec += 1;
+        deadline.tv_nsec -= 1000000000L;
+    }
+
+    return deadline;
+}
+
+
+/*
+ * Cleanup handler for threads cancelled while waiting
+ **/
+static void abandon_wait(void *args) {
+    struct fairshare_wait_t *wait = (struct fairshare_wait_t *)args;
+    struct fairshare_t *fairshare = wait->client->fairshare;
+
+    if (wait->waiter->granted) {
+        fairshare->slots++;
+
+        if (dispatch(fairshare))
+            pthread_cond_broadcast(&fairshare->granted);
+    }
+    else {
+        dequeue(fairshare, wait->client, wait->waiter);
+    }
+
+    pthread_mutex_unlock(&fairshare->lock);
+}
+
+
+/*
+ * Initialize with per-client rates in bytes per second, 0 for unlimited,
+ * and the number of requests to run at once.
+ * Return 0 on success or -1 on error.
+ **/
+int fairshare_init(struct fairshare_t *fairshare, size_t append_rate, size_t replay_rate, unsigned slots) {
+    memset(fairshare, 0, sizeof(struct fairshare_t));
+    fairshare->rates[FAIRSHARE_APPEND] = append_rate;
+    fairshare->rates[FAIRSHARE_REPLAY] = replay_rate;
+    fairshare->slots = slots;
+
+    if (slots == 0)
+        return -1;
+
+    pthread_condattr_t condattr;
+    pthread_condattr_init(&condattr);
+    pthread_condattr_setclock(&condattr, CLOCK_MONOTONIC);
+
+    pthread_mutex_init(&fairshare->lock, NULL);
+    pthread_cond_init(&fairshare->granted, &condattr);
+
+    pthread_condattr_destroy(&condattr);
+
+    return 0;
+}
+
+
+/*
+ * Report the throttle counters and free the client table,
+ * all connections must be gone.
+ **/
+void fairshare_destroy(struct fairshare_t *fairshare) {
+    if (fairshare->throttled[FAIRSHARE_APPEND] || fairshare->throttled[FAIRSHARE_REPLAY]) {
+        asynclog_write(LOG_INFO, "Throttled %lu %s and %lu %s by rate limit",
+            fairshare->throttled[FAIRSHARE_APPEND], kind_names[FAIRSHARE_APPEND],
+            fairshare->throttled[FAIRSHARE_REPLAY], kind_names[FAIRSHARE_REPLAY]);
+    }
+
+    for (int i = 0; i < FAIRSHARE_BUCKETS; i++) {
+        while (fairshare->clients[i] != NULL) {
+            struct fairshare_client_t *client = fairshare->clients[i];
+            fairshare->clients[i] = client->chain;
+            free(client);
+        }
+    }
+
+    pthread_cond_destroy(&fairshare->granted);
+    pthread_mutex_destroy(&fairshare->lock);
+}
+
+
+/*
+ * Look up or create the entry of a client address. Entries outlive their
+ * connections, so reconnecting does not refill the buckets. Idle entries
+ * with full buckets are dropped on the way.
+ * Return the entry or NULL on error.
+ **/
+struct fairshare_client_t *fairshare_attach(struct fairshare_t *fairshare, const char *ip) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    pthread_mutex_lock(&fairshare->lock);
+
+    struct fairshare_client_t **link = &fairshare->clients[hash_ip(ip)];
+    struct fairshare_client_t *client = NULL;
+
+    while (*link != NULL) {
+        struct fairshare_client_t *entry = *link;
+
+        if (strcmp(entry->ip, ip) == 0) {
+            client = entry;
+            link = &entry->chain;
+            continue;
+        }
+
+        refill(fairshare, entry, FAIRSHARE_APPEND, &now);
+        refill(fairshare, entry, FAIRSHARE_REPLAY, &now);
+
+        bool idle = entry->refs == 0
+            && entry->buckets[FAIRSHARE_APPEND].tokens >= fairshare->rates[FAIRSHARE_APPEND]
+            && entry->buckets[FAIRSHARE_REPLAY].tokens >= fairshare->rates[FAIRSHARE_REPLAY];
+
+        if (idle) {
+            *link = entry->chain;
+            free(entry);
+        }
+        else {
+            link = &entry->chain;
+        }
+    }
+
+    if (client == NULL) {
+        client = calloc(1, sizeof(struct fairshare_client_t));
+
+        if (client != NULL) {
+            strncpy(client->ip, ip, sizeof(client->ip) - 1);
+            client->fairshare = fairshare;
+
+            for (int kind = 0; kind < FAIRSHARE_KINDS; kind++) {
+                client->buckets[kind].tokens = fairshare->rates[kind];
+                client->buckets[kind].refilled = now;
+            }
+
+            client->chain = fairshare->clients[hash_ip(ip)];
+            fairshare->clients[hash_ip(ip)] = client;
+        }
+    }
+
+    if (client != NULL)
+        client->refs++;
+
+    pthread_mutex_unlock(&fairshare->lock);
+
+    return client;
+}
+
+
+/*
+ * Drop a connection's reference, the entry stays until it is idle.
+ **/
+void fairshare_detach(struct fairshare_client_t *client) {
+    struct fairshare_t *fairshare = client->fairshare;
+
+    pthread_mutex_lock(&fairshare->lock);
+
+    if (client->throttled[FAIRSHARE_APPEND] || client->throttled[FAIRSHARE_REPLAY]) {
+        asynclog_conn(client->ip, LOG_DEBUG, "Throttled %lu %s and %lu %s of %s so far",
+            client->throttled[FAIRSHARE_APPEND], kind_names[FAIRSHARE_APPEND],
+            client->throttled[FAIRSHARE_REPLAY], kind_names[FAIRSHARE_REPLAY], client->ip);
+    }
+
+    client->refs--;
+
+    pthread_mutex_unlock(&fairshare->lock);
+}
+
+
+/*
+ * Wait for the client's turn and a bucket out of debt.
+ **/
+void fairshare_acquire(struct fairshare_client_t *client, enum fairshare_kind_t kind) {
+    struct fairshare_t *fairshare = client->fairshare;
+    struct fairshare_waiter_t waiter = { .kind = kind };
+    struct fairshare_wait_t wait = { client, &waiter };
+
+    pthread_mutex_lock(&fairshare->lock);
+    pthread_cleanup_push(abandon_wait, &wait);
+
+    enqueue(fairshare, client, &waiter);
+
+    if (dispatch(fairshare))
+        pthread_cond_broadcast(&fairshare->granted);
+
+    while (!waiter.granted) {
+        struct timespec deadline = wakeup_time(fairshare, client, kind);
+
+        /* on timeout the bucket may have refilled, nobody else would notice */
+        if (pthread_cond_timedwait(&fairshare->granted, &fairshare->lock, &deadline) != 0 && dispatch(fairshare))
+            pthread_cond_broadcast(&fairshare->granted);
+    }
+
+    pthread_cleanup_pop(0);
+    pthread_mutex_unlock(&fairshare->lock);
+}
+
+
+/*
+ * Give back the slot and charge the bytes moved to the client's bucket.
+ **/
+void fairshare_release(struct fairshare_client_t *client, enum fairshare_kind_t kind, size_t bytes) {
+    struct fairshare_t *fairshare = client->fairshare;
+
+    pthread_mutex_lock(&fairshare->lock);
+
+    if (fairshare->rates[kind] > 0)
+        client->buckets[kind].tokens -= bytes;
+
+    fairshare->slots++;
+
+    if (dispatch(fairshare))
+        pthread_cond_broadcast(&fairshare->granted);
+
+    pthread_mutex_unlock(&fairshare->lock);
+}
+
+
+static void destroy_fairshare_replay_res(void *args) {
+    struct fairshare_replay_res *res = (struct fairshare_replay_res *)args;
+
+    if (res->chunk) fclose(res->chunk);
+    if (res->chunkdata) free(res->chunkdata);
+}
+
+
+/*
+ * Replay whole lines from instream to outstream chunk by chunk, so long
+ * replays interleave with those of other clients.
+ * The slot is only held while reading the log, never while writing to
+ * a client that may not read, cancellation would leak it.
+ * Return number of bytes sent, 0 if nothing could be sent.
+ **/
+ssize_t fairshare_replay(struct fairshare_client_t *client, FILE *instream, FILE *outstream) {
+    struct fairshare_replay_res res = { 0 };
+    size_t chunklen = 0;
+    ssize_t transsum = 0;
+
+    pthread_cleanup_push(destroy_fairshare_replay_res, &res);
+
+    res.chunk = open_memstream(&res.chunkdata, &chunklen);
+
+    while (res.chunk != NULL) {
+        int cancelstate;
+
+        rewind(res.chunk);
+
+        fairshare_acquire(client, FAIRSHARE_REPLAY);
+        pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &cancelstate);
+        ssize_t transres = transfer_lines(instream, res.chunk, FAIRSHARE_CHUNK);
+        fairshare_release(client, FAIRSHARE_REPLAY, transres > 0 ? transres : 0);
+        pthread_setcancelstate(cancelstate, NULL);
+
+        if (transres <= 0)
+            break;
+
+        if (fwrite(res.chunkdata, 1, transres, outstream) != (size_t)transres || fflush(outstream) != 0)
+            break;
+
+        transsum += transres;
+    }
+
+    pthread_cleanup_pop(1);
+
+    return transsum;
+}
@@ -0,0 +1,75 @@
+#ifndef AESDSOCKET_FAIRSHARE_H
+#define AESDSOCKET_FAIRSHARE_H
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <arpa/inet.h>
+#include <pthread.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <sys/types.h>
+#include <time.h>
+
+/*
+ * Fair sharing of the log between clients, identified by their address.
+ * At most `slots` appends or replay chunks run at once, pending requests
+ * are granted round-robin across clients, oldest first within a client.
+ * Every client has a token bucket per direction refilled at its rate,
+ * a request may start while the bucket is not in debt and is charged
+ * with the bytes it actually moved when done.
+ **/
+#define FAIRSHARE_BUCKETS 256          /* hash table size of the client table */
+#define FAIRSHARE_CHUNK (64 * 1024)    /* replays are scheduled in chunks of this size */
+#define FAIRSHARE_POLL_MS 100          /* backstop for waiters, throttled ones wake earlier */
+
+enum fairshare_kind_t {
+    FAIRSHARE_APPEND = 0,
+    FAIRSHARE_REPLAY = 1,
+    FAIRSHARE_KINDS
+};
+
+struct fairshare_bucket_t {
+    double tokens; /* bytes, negative while in debt */
+    struct timespec refilled;
+};
+
+struct fairshare_waiter_t;
+
+struct fairshare_client_t {
+    char ip[INET6_ADDRSTRLEN];
+    struct fairshare_t *fairshare;
+    unsigned refs;                          /* attached connections */
+    struct fairshare_bucket_t buckets[FAIRSHARE_KINDS];
+    unsigned long throttled[FAIRSHARE_KINDS];
+    struct fairshare_waiter_t *head, *tail; /* pending requests */
+    struct fairshare_client_t *prev, *next; /* ring of clients with pending requests */
+    struct fairshare_client_t *chain;       /* client table */
+};
+
+struct fairshare_t {
+    pthread_mutex_t lock;
+    pthread_cond_t granted;
+    size_t rates[FAIRSHARE_KINDS]; /* bytes per second per client, 0 for unlimited */
+    unsigned slots;                /* free slots */
+    struct fairshare_client_t *cursor; /* next client in round-robin order */
+    struct fairshare_client_t *clients[FAIRSHARE_BUCKETS];
+    unsigned long throttled[FAIRSHARE_KINDS];
+};
+
+int fairshare_init(struct fairshare_t *fairshare, size_t append_rate, size_t replay_rate, unsigned slots);
+
+void fairshare_destroy(struct fairshare_t *fairshare);
+
+struct fairshare_client_t *fairshare_attach(struct fairshare_t *fairshare, const char *ip);
+
+void fairshare_detach(struct fairshare_client_t *client);
+
+void fairshare_acquire(struct fairshare_client_t *client, enum fairshare_kind_t kind);
+
+void fairshare_release(struct fairshare_client_t *client, enum fairshare_kind_t kind, size_t bytes);
+
+ssize_t fairshare_replay(struct fairshare_client_t *client, FILE *instream, FILE *outstream);
+
+#endif//AESDSOCKET_FAIRSHARE_H
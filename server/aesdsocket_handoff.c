@@ -0,0 +1,310 @@
+#include "aesdsocket_handoff.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "aesdsocket_asynclog.h"
+
+
+#define HANDOFF_DRAINED "DRAINED\n"
+
+
+/*
+ * Fill in a UNIX socket address, return -1 if the path is too long.
+ **/
+static int make_addr(struct sockaddr_un *addr, const char *path) {
+    memset(addr, 0, sizeof(*addr));
+    addr->sun_family = AF_UNIX;
+
+    if (strlen(path) >= sizeof(addr->sun_path))
+        return -1;
+
+    strcpy(addr->sun_path, path);
+    return 0;
+}
+
+
+void handoff_init(struct handoff_t *handoff, const char *path) {
+    memset(handoff, 0, sizeof(*handoff));
+    handoff->path = path;
+    handoff->listen_fd = -1;
+    handoff->successor_fd = -1;
+    handoff->predecessor_fd = -1;
+    handoff->sock = -1;
+    handoff->datafd = -1;
+}
+
+
+/*
+ * Take over the listening socket and data file of a running predecessor.
+ * Return the connection to the predecessor, or -1 if there is none and
+ * the caller has to bind on its own.
+ **/
+int handoff_takeover(struct handoff_t *handoff, int *sock, int *datafd) {
+    struct sockaddr_un addr;
+
+    if (make_addr(&addr, handoff->path) != 0) {
+        asynclog_write(LOG_ERR, "Handoff path %s too long", handoff->path);
+        return -1;
+    }
+
+    int conn = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+
+    if (conn < 0)
+        return -1;
+
+    if (connect(conn, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+        /* nobody listening, remove a leftover of a crashed predecessor */
+        if (errno == ECONNREFUSED)
+            unlink(handoff->path);
+
+        close(conn);
+        return -1;
+    }
+
+    char byte;
+    struct iovec iov = { .iov_base = &byte, .iov_len = 1 };
+
+    union {
+        char buf[CMSG_SPACE(2 * sizeof(int))];
+        struct cmsghdr align;
+    } control;
+
+    struct msghdr msg = {
+        .msg_iov = &iov,
+        .msg_iovlen = 1,
+        .msg_control = control.buf,
+        .msg_controllen = sizeof(control.buf),
+    };
+
+    ssize_t result;
+    do {
+        result = recvmsg(conn, &msg, MSG_CMSG_CLOEXEC);
+    } while (result < 0 && errno == EINTR);
+
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+
+    if (result != 1 || cmsg == NULL || cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS) {
+        asynclog_write(LOG_ERR, "Invalid handoff from predecessor on %s", handoff->path);
+        close(conn);
+        return -1;
+    }
+
+    int fds[2] = { -1, -1 };
+    size_t nfds = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+
+    memcpy(fds, CMSG_DATA(cmsg), (nfds > 2 ? 2 : nfds) * sizeof(int));
+
+    *sock = fds[0];
+    *datafd = fds[1];
+
+    asynclog_write(LOG_INFO, "Took over %zu descriptors from predecessor on %s", nfds, handoff->path);
+
+    return conn;
+}
+
+
+/*
+ * Thread function releasing held appends once the predecessor is drained
+ **/
+static void *handoff_awaiter(void *args) {
+    struct handoff_t *handoff = (struct handoff_t *)args;
+
+    struct timeval timeout = { .tv_sec = HANDOFF_WAIT_S, .tv_usec = 0 };
+    setsockopt(handoff->predecessor_fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+    char buffer[sizeof(HANDOFF_DRAINED)] = { 0 };
+    size_t received = 0;
+
+    /* EOF means the predecessor died, its file is as drained as it gets */
+    while (received < sizeof(buffer) - 1) {
+        ssize_t result = recv(handoff->predecessor_fd, buffer + received, sizeof(buffer) - 1 - received, 0);
+
+        if (result < 0 && errno == EINTR)
+            continue;
+
+        if (result <= 0)
+            break;
+
+        received += result;
+    }
+
+    int oldstate;
+    pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &oldstate);
+
+    if (strcmp(buffer, HANDOFF_DRAINED) != 0)
+        asynclog_write(LOG_WARNING, "Predecessor did not report being drained, releasing appends anyway");
+
+    if (datalog_release(handoff->datalog) != 0)
+        asynclog_write(LOG_ERR, "Error rescanning data file after handoff");
+    else
+        asynclog_write(LOG_INFO, "Handoff complete, appends released");
+
+    close(handoff->predecessor_fd);
+    handoff->predecessor_fd = -1;
+
+    return NULL;
+}
+
+
+/*
+ * Wait in the background for the predecessor to drain, then release
+ * the datalog, which has to be held by the caller.
+ **/
+int handoff_await(struct handoff_t *handoff, int predecessor, struct datalog_t *datalog) {
+    handoff->predecessor_fd = predecessor;
+    handoff->datalog = datalog;
+
+    if (pthread_create(&handoff->await_id, NULL, handoff_awaiter, handoff) != 0)
+        return -1;
+
+    handoff->awaiting = true;
+    return 0;
+}
+
+
+/*
+ * Pass the descriptors to a successor on an accepted connection.
+ **/
+static int send_descriptors(struct handoff_t *handoff, int conn) {
+    int fds[2] = { handoff->sock, handoff->datafd };
+    int nfds = handoff->datafd < 0 ? 1 : 2;
+
+    char byte = 'H';
+    struct iovec iov = { .iov_base = &byte, .iov_len = 1 };
+
+    union {
+        char buf[CMSG_SPACE(2 * sizeof(int))];
+        struct cmsghdr align;
+    } control;
+    memset(&control, 0, sizeof(control));
+
+    struct msghdr msg = {
+        .msg_iov = &iov,
+        .msg_iovlen = 1,
+        .msg_control = control.buf,
+        .msg_controllen = CMSG_SPACE(nfds * sizeof(int)),
+    };
+
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(nfds * sizeof(int));
+    memcpy(CMSG_DATA(cmsg), fds, nfds * sizeof(int));
+
+    ssize_t result;
+    do {
+        result = sendmsg(conn, &msg, MSG_NOSIGNAL);
+    } while (result < 0 && errno == EINTR);
+
+    return result == 1 ? 0 : -1;
+}
+
+
+/*
+ * Accept a successor and pass the descriptors to it, call when the
+ * handoff socket is readable. Return 0 once handed off, the caller must
+ * stop accepting connections then, or -1 if no successor connected.
+ **/
+int handoff_accept(struct handoff_t *handoff) {
+    int conn = accept4(handoff->listen_fd, NULL, NULL, SOCK_CLOEXEC);
+
+    if (conn < 0)
+        return -1;
+
+    /* free the path first, the successor binds it once it has the descriptors */
+    close(handoff->listen_fd);
+    handoff->listen_fd = -1;
+    unlink(handoff->path);
+
+    if (send_descriptors(handoff, conn) != 0) {
+        /* the path is gone already, there is no way back */
+        asynclog_write(LOG_ERR, "Error handing off descriptors, exiting anyway");
+        close(conn);
+    }
+    else {
+        asynclog_write(LOG_INFO, "Handed off to successor, draining");
+        handoff->successor_fd = conn;
+    }
+
+    handoff->completed = true;
+    return 0;
+}
+
+
+/*
+ * Bind the handoff path, poll listen_fd and call handoff_accept() when
+ * it becomes readable.
+ **/
+int handoff_listen(struct handoff_t *handoff, int sock, int datafd) {
+    struct sockaddr_un addr;
+
+    if (make_addr(&addr, handoff->path) != 0) {
+        asynclog_write(LOG_ERR, "Handoff path %s too long", handoff->path);
+        return -1;
+    }
+
+    handoff->sock = sock;
+    handoff->datafd = datafd;
+    handoff->listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+
+    if (handoff->listen_fd < 0)
+        return -1;
+
+    if (bind(handoff->listen_fd, (struct sockaddr *)&addr, sizeof(addr)) != 0 || listen(handoff->listen_fd, 1) != 0) {
+        asynclog_write(LOG_ERR, "Error binding handoff socket %s: %s", handoff->path, strerror(errno));
+        close(handoff->listen_fd);
+        handoff->listen_fd = -1;
+        return -1;
+    }
+
+    return 0;
+}
+
+
+bool handoff_completed(struct handoff_t *handoff) {
+    return handoff->completed;
+}
+
+
+/*
+ * Tell the successor the log is flushed and it may take over appends.
+ **/
+void handoff_notify_drained(struct handoff_t *handoff) {
+    if (handoff->successor_fd < 0)
+        return;
+
+    send(handoff->successor_fd, HANDOFF_DRAINED, strlen(HANDOFF_DRAINED), MSG_NOSIGNAL);
+    close(handoff->successor_fd);
+    handoff->successor_fd = -1;
+}
+
+
+/*
+ * Stop waiting for the predecessor and give up the handoff path,
+ * call once the server loop ended.
+ **/
+void handoff_stop(struct handoff_t *handoff) {
+    /* still ours if nobody took over */
+    if (handoff->listen_fd >= 0) {
+        close(handoff->listen_fd);
+        handoff->listen_fd = -1;
+        unlink(handoff->path);
+    }
+
+    if (handoff->awaiting) {
+        pthread_cancel(handoff->await_id);
+        pthread_join(handoff->await_id, NULL);
+        handoff->awaiting = false;
+    }
+
+    if (handoff->predecessor_fd >= 0) {
+        close(handoff->predecessor_fd);
+        handoff->predecessor_fd = -1;
+    }
+}
@@ -0,0 +1,56 @@
+#ifndef AESDSOCKET_HANDOFF_H
+#define AESDSOCKET_HANDOFF_H
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <pthread.h>
+#include <stdbool.h>
+
+#include "aesdsocket_datalog.h"
+
+/*
+ * Hot restart, both processes are started with the same UNIX socket path:
+ *   1. the successor connects to the path of the running predecessor
+ *   2. the predecessor unlinks the path and passes its listening socket
+ *      and data file descriptor with SCM_RIGHTS
+ *   3. the successor binds the path for the next upgrade and starts
+ *      accepting on the inherited socket, appends are held back
+ *   4. the predecessor stops accepting, drains its connections,
+ *      flushes the log and sends "DRAINED" before exiting
+ *   5. the successor resyncs its log counters and releases appends
+ **/
+#define HANDOFF_DRAIN_MS 5000 /* cancel connections still open after this */
+#define HANDOFF_WAIT_S 30     /* release appends even without DRAINED after this */
+
+struct handoff_t {
+    const char *path;
+    int listen_fd;    /* UNIX socket successors connect to */
+    int successor_fd; /* connection to the successor once handed off */
+    int predecessor_fd; /* connection to the predecessor while draining */
+    struct datalog_t *datalog;
+    int sock;         /* descriptors to hand over */
+    int datafd;
+    pthread_t await_id;
+    bool awaiting;
+    bool completed;
+};
+
+void handoff_init(struct handoff_t *handoff, const char *path);
+
+int handoff_takeover(struct handoff_t *handoff, int *sock, int *datafd);
+
+int handoff_await(struct handoff_t *handoff, int predecessor, struct datalog_t *datalog);
+
+int handoff_listen(struct handoff_t *handoff, int sock, int datafd);
+
+int handoff_accept(struct handoff_t *handoff);
+
+bool handoff_completed(struct handoff_t *handoff);
+
+void handoff_notify_drained(struct handoff_t *handoff);
+
+void handoff_stop(struct handoff_t *handoff);
+
+#endif//AESDSOCKET_HANDOFF_H
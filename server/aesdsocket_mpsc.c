@@ -0,0 +1,60 @@
+#include "aesdsocket_mpsc.h"
+
+#include <stddef.h>
+
+
+void mpsc_queue_init(struct mpsc_queue_t *queue) {
+    atomic_init(&queue->stub.next, NULL);
+    atomic_init(&queue->head, &queue->stub);
+    queue->tail = &queue->stub;
+}
+
+
+/*
+ * Enqueue a node, wait-free.
+ **/
+void mpsc_queue_push(struct mpsc_queue_t *queue, struct mpsc_node_t *node) {
+    atomic_store_explicit(&node->next, NULL, memory_order_relaxed);
+    struct mpsc_node_t *prev = atomic_exchange_explicit(&queue->head, node, memory_order_acq_rel);
+    atomic_store_explicit(&prev->next, node, memory_order_release);
+}
+
+
+/*
+ * Dequeue the oldest node.
+ * Return NULL if the queue is empty or a producer is midway through a push,
+ * in which case its node becomes visible once the push completes.
+ **/
+struct mpsc_node_t *mpsc_queue_pop(struct mpsc_queue_t *queue) {
+    struct mpsc_node_t *tail = queue->tail;
+    struct mpsc_node_t *next = atomic_load_explicit(&tail->next, memory_order_acquire);
+
+    if (tail == &queue->stub) {
+        if (next == NULL)
+            return NULL;
+
+        queue->tail = next;
+        tail = next;
+        next = atomic_load_explicit(&tail->next, memory_order_acquire);
+    }
+
+    if (next != NULL) {
+        queue->tail = next;
+        return tail;
+    }
+
+    if (tail != atomic_load_explicit(&queue->head, memory_order_acquire))
+        return NULL;
+
+    /* last node, push the stub behind it so it can be detached */
+    mpsc_queue_push(queue, &queue->stub);
+
+    next = atomic_load_explicit(&tail->next, memory_order_acquire);
+
+    if (next != NULL) {
+        queue->tail = next;
+        return tail;
+    }
+
+    return NULL;
+}
@@ -0,0 +1,31 @@
+#ifndef AESDSOCKET_MPSC_H
+#define AESDSOCKET_MPSC_H
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <stdatomic.h>
+
+/*
+ * Intrusive lock-free multi-producer single-consumer queue (Vyukov).
+ * Embed mpsc_node_t in the queued struct, any thread may push,
+ * only one thread may pop.
+ **/
+struct mpsc_node_t {
+    struct mpsc_node_t *_Atomic next;
+};
+
+struct mpsc_queue_t {
+    struct mpsc_node_t *_Atomic head; /* producers push here */
+    struct mpsc_node_t *tail;         /* consumer pops here */
+    struct mpsc_node_t stub;
+};
+
+void mpsc_queue_init(struct mpsc_queue_t *queue);
+
+void mpsc_queue_push(struct mpsc_queue_t *queue, struct mpsc_node_t *node);
+
+struct mpsc_node_t *mpsc_queue_pop(struct mpsc_queue_t *queue);
+
+#endif//AESDSOCKET_MPSC_H
@@ -0,0 +1,84 @@
+#include "aesdsocket_net.h"
+
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "aesdsocket_asynclog.h"
+
+
+/*
+ * Get the ip address from a sockaddr struct as string.
+ * Allocate output parameter `str` accordingly.
+ **/
+char *get_addr_str(struct sockaddr *sa) {
+    char *str;
+
+    switch(sa->sa_family) {
+        case AF_INET: { /* ipv4 */
+            struct in_addr ina = ((struct sockaddr_in*)sa)->sin_addr;
+            str = calloc(sizeof(char), INET_ADDRSTRLEN);
+            inet_ntop(AF_INET, &ina, str, INET_ADDRSTRLEN);
+            break; }
+        case AF_INET6: {/* ipv6 */
+            struct in6_addr in6a = ((struct sockaddr_in6*)sa)->sin6_addr;
+            str = calloc(sizeof(char), INET6_ADDRSTRLEN);
+            inet_ntop(AF_INET6, &in6a, str, INET6_ADDRSTRLEN);
+            break; }
+        default: /* should not happen */
+            return "";
+    }
+
+    return str;
+}
+
+
+/*
+ * Create a socket that binds to the specified port.
+ */
+int bind_to_port(const char* port) {
+    int result, sock;
+    struct addrinfo hints = {0}, *sockinfo = NULL, *si;
+
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_PASSIVE;
+
+    result = getaddrinfo(NULL, port, &hints, &sockinfo);
+
+    if (result != 0) {
+        asynclog_write(LOG_ERR, "getaddrinfo: %s\n", gai_strerror(result));
+        return -1;
+    }
+
+    for (si = sockinfo; si != NULL; si = si->ai_next) {
+        sock = socket(si->ai_family, si->ai_socktype, si->ai_protocol);
+
+        if (sock == -1)
+            continue;
+
+        const int enable = 1; /* boolean integer flag */
+        setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &enable, sizeof(enable));
+        setsockopt(sock, SOL_SOCKET, SO_REUSEPORT, &enable, sizeof(enable));
+
+        if (bind(sock, si->ai_addr, si->ai_addrlen) == 0)
+            break;
+
+        close(sock);
+    }
+
+    if (si == NULL) {
+        asynclog_write(LOG_ERR, "Error binding to port %s!\n", port);
+        sock = -1;
+    }
+    else {
+        char *sockaddr = get_addr_str(si->ai_addr);
+        asynclog_write(LOG_INFO, "Socket bound to %s\n", sockaddr);
+        free(sockaddr);
+    }
+
+    freeaddrinfo(sockinfo);
+
+    return sock;
+}
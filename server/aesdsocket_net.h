@@ -0,0 +1,14 @@
+#ifndef AESDSOCKET_NET_H
+#define AESDSOCKET_NET_H
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <sys/socket.h>
+
+char *get_addr_str(struct sockaddr *sa);
+
+int bind_to_port(const char *port);
+
+#endif//AESDSOCKET_NET_H
@@ -0,0 +1,663 @@
+#include "aesdsocket_persist.h"
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "aesdsocket_asynclog.h"
+#include "aesdsocket_coldstore.h"
+
+
+#define PERSIST_VERIFY_BATCH 256 /* index entries read at once */
+#define PERSIST_ADOPT_CHUNK (1024 * 1024 * 1024) /* longest record of an adopted file */
+
+
+static uint32_t crc32_table[256];
+static pthread_once_t crc32_table_once = PTHREAD_ONCE_INIT;
+
+
+static void build_crc32_table() {
+    for (uint32_t i = 0; i < 256; ++i) {
+        uint32_t c = i;
+
+        for (int k = 0; k < 8; ++k)
+            c = (c & 1) ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+
+        crc32_table[i] = c;
+    }
+}
+
+
+/*
+ * Table driven CRC-32 (IEEE 802.3), pass 0 as initial crc.
+ **/
+uint32_t persist_crc32(uint32_t crc, const void *buffer, size_t buflen) {
+    pthread_once(&crc32_table_once, build_crc32_table);
+
+    const uint8_t *bytes = buffer;
+    crc = ~crc;
+
+    while (buflen-- > 0)
+        crc = crc32_table[(crc ^ *bytes++) & 0xFF] ^ (crc >> 8);
+
+    return ~crc;
+}
+
+
+/*
+ * Continue the CRC-32 in *crc over a data file range.
+ * Return 0 on success or -1 if the range could not be read completely.
+ **/
+static int checksum_range(FILE *file, size_t offset, size_t length, uint32_t *crc) {
+    char buffer[BUFSIZ];
+
+    /* ranges are consecutive, only seek at the start */
+    if (ftello(file) != (off_t)offset && fseeko(file, offset, SEEK_SET) != 0)
+        return -1;
+
+    while (length > 0) {
+        size_t readlen = fread(buffer, 1, length < sizeof(buffer) ? length : sizeof(buffer), file);
+
+        if (readlen == 0)
+            return -1;
+
+        *crc = persist_crc32(*crc, buffer, readlen);
+        length -= readlen;
+    }
+
+    return 0;
+}
+
+
+/*
+ * Read and validate the checkpoint, zero it if missing or invalid.
+ **/
+static void read_checkpoint(struct persist_t *persist, struct persist_checkpoint_t *checkpoint) {
+    int fd = open(persist->checkpointname, O_RDONLY);
+    bool valid = false;
+
+    if (fd >= 0) {
+        valid = read(fd, checkpoint, sizeof(*checkpoint)) == sizeof(*checkpoint)
+            && checkpoint->magic == PERSIST_CHECKPOINT_MAGIC
+            && checkpoint->crc == persist_crc32(0, checkpoint, offsetof(struct persist_checkpoint_t, crc));
+        close(fd);
+    }
+
+    if (!valid) {
+        memset(checkpoint, 0, sizeof(*checkpoint));
+    }
+}
+
+
+/*
+ * Index the contents of a data file that has no index yet,
+ * e.g. when switching an existing log to persistent mode.
+ * Lines become records, like the text protocol appends them.
+ * Return 0 on success or -1 on error.
+ **/
+static int adopt_datafile(struct persist_t *persist, FILE *data, size_t datasize) {
+    struct persist_index_entry_t batch[PERSIST_VERIFY_BATCH];
+    struct persist_index_entry_t *entry = &batch[0];
+    size_t count = 0;
+    char buffer[BUFSIZ];
+    uint32_t crc = 0;
+
+    if (fseeko(data, 0, SEEK_SET) != 0)
+        return -1;
+
+    *entry = (struct persist_index_entry_t){ 0 };
+
+    for (size_t offset = 0; offset < datasize; ) {
+        size_t readlen = fread(buffer, 1, datasize - offset < sizeof(buffer) ? datasize - offset : sizeof(buffer), data);
+
+        if (readlen == 0)
+            return -1;
+
+        for (size_t pos = 0; pos < readlen; ) {
+            const char *newline = memchr(buffer + pos, '\n', readlen - pos);
+            size_t linelen = newline ? (size_t)(newline - buffer) + 1 - pos : readlen - pos;
+
+            if (linelen > PERSIST_ADOPT_CHUNK - entry->length)
+                linelen = PERSIST_ADOPT_CHUNK - entry->length;
+
+            crc = persist_crc32(crc, buffer + pos, linelen);
+            entry->length += linelen;
+            pos += linelen;
+
+            bool complete = (pos > 0 && buffer[pos - 1] == '\n') || entry->length == PERSIST_ADOPT_CHUNK
+                || (offset + pos == datasize);
+
+            if (!complete)
+                continue;
+
+            entry->crc = crc;
+
+            if (++count == PERSIST_VERIFY_BATCH) {
+                if (write(persist->indexfd, batch, sizeof(batch)) != sizeof(batch))
+                    return -1;
+
+                count = 0;
+            }
+
+            entry = &batch[count];
+            *entry = (struct persist_index_entry_t){ .offset = offset + pos };
+        }
+
+        offset += readlen;
+    }
+
+    ssize_t len = count * sizeof(batch[0]);
+
+    if (count > 0 && write(persist->indexfd, batch, len) != len)
+        return -1;
+
+    asynclog_write(LOG_INFO, "Indexed existing data file of %zu bytes", datasize);
+
+    return 0;
+}
+
+
+/*
+ * Verify index entries after the checkpoint and truncate torn writes.
+ * The data file is read through `data`, which covers cold segments.
+ * Return 0 on success or -1 on error.
+ **/
+static int recover(struct persist_t *persist, FILE *data, struct datalog_pos_t *pos) {
+    struct stat datastat, indexstat;
+
+    if (fstat(persist->datafd, &datastat) != 0 || fstat(persist->indexfd, &indexstat) != 0)
+        return -1;
+
+    if (indexstat.st_size == 0 && datastat.st_size > 0) {
+        if (adopt_datafile(persist, data, datastat.st_size) != 0 || fstat(persist->indexfd, &indexstat) != 0)
+            return -1;
+    }
+
+    struct persist_checkpoint_t checkpoint;
+    read_checkpoint(persist, &checkpoint);
+
+    size_t indexed = indexstat.st_size / sizeof(struct persist_index_entry_t);
+    struct persist_index_entry_t batch[PERSIST_VERIFY_BATCH];
+
+    /* a checkpoint beyond the files on disk is stale, verify everything */
+    if (checkpoint.entries > indexed || checkpoint.bytes > (size_t)datastat.st_size) {
+        asynclog_write(LOG_ERR, "Checkpoint is ahead of the data on disk, verifying the whole log");
+        memset(&checkpoint, 0, sizeof(checkpoint));
+    }
+
+    /* the running CRC continues from the last checkpointed record */
+    if (checkpoint.entries > 0 && persist_read_entries(persist, checkpoint.entries - 1, batch, 1) != 1) {
+        memset(&checkpoint, 0, sizeof(checkpoint));
+    }
+
+    uint32_t crc = checkpoint.entries > 0 ? batch[0].crc : 0;
+
+    pos->bytes = checkpoint.bytes;
+    pos->records = checkpoint.records;
+    persist->entries = checkpoint.entries;
+
+    bool torn = false;
+
+    while (!torn && persist->entries < indexed) {
+        ssize_t count = persist_read_entries(persist, persist->entries, batch, PERSIST_VERIFY_BATCH);
+
+        if (count < 0)
+            return -1;
+
+        for (ssize_t i = 0; i < count; ++i) {
+            uint32_t running = crc;
+
+            if (batch[i].offset != pos->bytes
+                    || checksum_range(data, batch[i].offset, batch[i].length, &running) != 0
+                    || running != batch[i].crc) {
+                torn = true;
+                break;
+            }
+
+            crc = running;
+            pos->bytes += batch[i].length;
+            pos->records += 1;
+            persist->entries += 1;
+        }
+
+        if (count == 0)
+            break;
+    }
+
+    size_t verified = persist->entries - checkpoint.entries;
+    size_t dropped = datastat.st_size - pos->bytes;
+
+    if (ftruncate(persist->datafd, pos->bytes) != 0
+            || ftruncate(persist->indexfd, persist->entries * sizeof(struct persist_index_entry_t)) != 0)
+        return -1;
+
+    persist->crc = crc;
+    persist->checkpoint_entries = checkpoint.entries;
+    persist->checkpoint_bytes = checkpoint.bytes;
+
+    if (persist->durable || pos->bytes > 0) {
+        asynclog_write(LOG_INFO, "Recovered %zu records (%zu bytes), verified %zu records after checkpoint",
+            pos->records, pos->bytes, verified);
+    }
+
+    if (dropped > 0) {
+        asynclog_write(LOG_ERR, "Dropped %zu bytes of torn or unindexed writes", dropped);
+    }
+
+    return 0;
+}
+
+
+/*
+ * Open the sidecar files of `datafile` and recover its valid prefix.
+ * Only a `durable` index is checkpointed.
+ * Return 0 on success or -1 on error.
+ **/
+int persist_open(struct persist_t *persist, const char *datafile, struct coldstore_t *cold, bool durable, struct datalog_pos_t *pos) {
+    memset(persist, 0, sizeof(struct persist_t));
+    persist->durable = durable;
+    persist->datafd = -1;
+    persist->indexfd = -1;
+
+    if (asprintf(&persist->indexname, "%s.idx", datafile) < 0) {
+        persist->indexname = NULL;
+        return -1;
+    }
+
+    if (asprintf(&persist->checkpointname, "%s.ckpt", datafile) < 0) {
+        persist->checkpointname = NULL;
+        return -1;
+    }
+
+    persist->datafd = open(datafile, O_RDWR|O_CREAT, 0644);
+    persist->indexfd = open(persist->indexname, O_RDWR|O_CREAT|O_APPEND, 0644);
+
+    if (persist->datafd < 0 || persist->indexfd < 0) {
+        return -1;
+    }
+
+    FILE *data = coldstore_fopen(cold, datafile);
+
+    if (data == NULL) {
+        return -1;
+    }
+
+    int result = recover(persist, data, pos);
+    fclose(data);
+
+    return result;
+}
+
+
+static void close_files(struct persist_t *persist) {
+    if (persist->datafd >= 0) close(persist->datafd);
+    if (persist->indexfd >= 0) close(persist->indexfd);
+    free(persist->indexname);
+    free(persist->checkpointname);
+}
+
+
+/*
+ * Write a final checkpoint if durable and close all files.
+ **/
+void persist_close(struct persist_t *persist, struct datalog_pos_t pos) {
+    if (persist->durable && persist->datafd >= 0 && persist->indexfd >= 0)
+        persist_checkpoint(persist, pos);
+
+    close_files(persist);
+}
+
+
+/*
+ * Add index entries for consecutive records starting at `offset`.
+ * Return 0 on success or -1 on error.
+ **/
+int persist_record(struct persist_t *persist, size_t offset, const struct iovec *iov, int iovcnt) {
+    struct persist_index_entry_t entries[iovcnt];
+    uint32_t crc = persist->crc;
+
+    for (int i = 0; i < iovcnt; ++i) {
+        if (iov[i].iov_len > UINT32_MAX)
+            return -1;
+
+        crc = persist_crc32(crc, iov[i].iov_base, iov[i].iov_len);
+        entries[i].offset = offset;
+        entries[i].length = iov[i].iov_len;
+        entries[i].crc = crc;
+        offset += iov[i].iov_len;
+    }
+
+    ssize_t len = iovcnt * sizeof(entries[0]);
+
+    if (write(persist->indexfd, entries, len) != len)
+        return -1;
+
+    persist->crc = crc;
+    persist->entries += iovcnt;
+
+    return 0;
+}
+
+
+/*
+ * Take the counters of a checkpoint, call with the log locked.
+ **/
+void persist_checkpoint_begin(struct persist_t *persist, struct datalog_pos_t pos, struct persist_checkpoint_t *checkpoint) {
+    *checkpoint = (struct persist_checkpoint_t){
+        .magic = PERSIST_CHECKPOINT_MAGIC,
+        .bytes = pos.bytes,
+        .records = pos.records,
+        .entries = persist->entries,
+    };
+
+    checkpoint->crc = persist_crc32(0, checkpoint, offsetof(struct persist_checkpoint_t, crc));
+}
+
+
+/*
+ * Sync data and index, then atomically replace the checkpoint file.
+ * Needs no log lock, appends beyond the checkpoint may go on meanwhile.
+ * Return 0 on success or -1 on error.
+ **/
+int persist_checkpoint_write(struct persist_t *persist, const struct persist_checkpoint_t *checkpoint) {
+    if (fdatasync(persist->datafd) != 0 || fdatasync(persist->indexfd) != 0)
+        return -1;
+
+    char *tmpname;
+
+    if (asprintf(&tmpname, "%s.tmp", persist->checkpointname) < 0)
+        return -1;
+
+    int result = -1;
+    int fd = open(tmpname, O_WRONLY|O_CREAT|O_TRUNC, 0644);
+
+    if (fd >= 0) {
+        if (write(fd, checkpoint, sizeof(*checkpoint)) == sizeof(*checkpoint) && fdatasync(fd) == 0)
+            result = 0;
+
+        close(fd);
+    }
+
+    if (result == 0)
+        result = rename(tmpname, persist->checkpointname);
+
+    if (result != 0)
+        unlink(tmpname);
+
+    free(tmpname);
+
+    return result;
+}
+
+
+/*
+ * Make a written checkpoint the current one, call with the log locked.
+ **/
+void persist_checkpoint_end(struct persist_t *persist, const struct persist_checkpoint_t *checkpoint) {
+    persist->checkpoint_entries = checkpoint->entries;
+    persist->checkpoint_bytes = checkpoint->bytes;
+}
+
+
+/*
+ * Write a checkpoint of `pos` in one go, while nothing else appends.
+ * Return 0 on success or -1 on error.
+ **/
+int persist_checkpoint(struct persist_t *persist, struct datalog_pos_t pos) {
+    struct persist_checkpoint_t checkpoint;
+
+    persist_checkpoint_begin(persist, pos, &checkpoint);
+
+    if (persist_checkpoint_write(persist, &checkpoint) != 0)
+        return -1;
+
+    persist_checkpoint_end(persist, &checkpoint);
+
+    return 0;
+}
+
+
+/*
+ * Drop index and checkpoint along with the data file contents.
+ * Return 0 on success or -1 on error.
+ **/
+int persist_reset(struct persist_t *persist) {
+    persist->crc = 0;
+    persist->entries = 0;
+    persist->checkpoint_entries = 0;
+    persist->checkpoint_bytes = 0;
+
+    if (ftruncate(persist->indexfd, 0) != 0)
+        return -1;
+
+    if (unlink(persist->checkpointname) != 0 && errno != ENOENT)
+        return -1;
+
+    return 0;
+}
+
+
+/*
+ * Delete the sidecar files of `datafile`.
+ **/
+void persist_remove(const char *datafile) {
+    char *name;
+
+    if (asprintf(&name, "%s.idx", datafile) >= 0) {
+        unlink(name);
+        free(name);
+    }
+
+    if (asprintf(&name, "%s.ckpt", datafile) >= 0) {
+        unlink(name);
+        free(name);
+    }
+}
+
+
+/*
+ * Read up to `count` index entries starting with entry `first`.
+ * Safe while records are appended, only whole entries count.
+ * Return number of entries read or -1 on error.
+ **/
+ssize_t persist_read_entries(struct persist_t *persist, size_t first, struct persist_index_entry_t *entries, size_t count) {
+    ssize_t readlen = pread(persist->indexfd, entries, count * sizeof(entries[0]), first * sizeof(entries[0]));
+
+    return readlen < 0 ? -1 : readlen / (ssize_t)sizeof(entries[0]);
+}
+
+
+/*
+ * Find the index entry of the record starting at `offset` by bisection,
+ * the end of the log counts as the entry after the last record.
+ * Return 0 with *entry set or -1 if no record starts there.
+ **/
+int persist_find(struct persist_t *persist, size_t offset, size_t *entry) {
+    struct stat indexstat;
+    struct persist_index_entry_t probe;
+
+    if (fstat(persist->indexfd, &indexstat) != 0)
+        return -1;
+
+    size_t low = 0, high = indexstat.st_size / sizeof(probe);
+
+    while (low < high) {
+        size_t mid = low + (high - low) / 2;
+
+        if (persist_read_entries(persist, mid, &probe, 1) != 1)
+            return -1;
+
+        if (probe.offset < offset)
+            low = mid + 1;
+        else
+            high = mid;
+    }
+
+    /* either a record starts at offset or the one before ends there */
+    if (persist_read_entries(persist, low, &probe, 1) == 1 && probe.offset == offset) {
+        *entry = low;
+        return 0;
+    }
+
+    if (low == 0 ? offset == 0 : persist_read_entries(persist, low - 1, &probe, 1) == 1 && probe.offset + probe.length == offset) {
+        *entry = low;
+        return 0;
+    }
+
+    return -1;
+}
+
+
+/*
+ * Get the running CRC-32 of the log up to index entry `entry`,
+ * e.g. as found by persist_find(), to compare logs by their prefix.
+ * Return 0 on success or -1 on error.
+ **/
+int persist_prefix_crc(struct persist_t *persist, size_t entry, uint32_t *crc) {
+    struct persist_index_entry_t last;
+
+    if (entry == 0) {
+        *crc = 0;
+        return 0;
+    }
+
+    if (persist_read_entries(persist, entry - 1, &last, 1) != 1)
+        return -1;
+
+    *crc = last.crc;
+
+    return 0;
+}
+
+
+/*
+ * State of a stream opened with persist_fopen_records()
+ **/
+struct persist_reader_t {
+    struct persist_t *persist;
+    FILE *data;
+    size_t bytes;  /* end of the records to read */
+    size_t offset; /* of the next record */
+    size_t next;   /* index entry of the next record */
+    struct persist_index_entry_t batch[PERSIST_VERIFY_BATCH];
+    size_t batchlen;
+    size_t batchpos;
+    uint32_t prefix;    /* length of the current record, network byte order */
+    size_t prefix_left;
+    size_t record_left;
+};
+
+
+static ssize_t reader_read(void *cookie, char *buf, size_t size) {
+    struct persist_reader_t *reader = (struct persist_reader_t *)cookie;
+    size_t readsum = 0;
+
+    while (readsum < size) {
+        size_t chunklen = size - readsum;
+
+        if (reader->prefix_left > 0) {
+            if (chunklen > reader->prefix_left)
+                chunklen = reader->prefix_left;
+
+            memcpy(buf + readsum, (char *)&reader->prefix + sizeof(reader->prefix) - reader->prefix_left, chunklen);
+            reader->prefix_left -= chunklen;
+            readsum += chunklen;
+            continue;
+        }
+
+        if (reader->record_left > 0) {
+            if (chunklen > reader->record_left)
+                chunklen = reader->record_left;
+
+            if (fread(buf + readsum, 1, chunklen, reader->data) != chunklen)
+                return -1;
+
+            reader->record_left -= chunklen;
+            readsum += chunklen;
+            continue;
+        }
+
+        if (reader->offset >= reader->bytes)
+            break;
+
+        if (reader->batchpos == reader->batchlen) {
+            ssize_t count = persist_read_entries(reader->persist, reader->next, reader->batch, PERSIST_VERIFY_BATCH);
+
+            if (count <= 0)
+                return -1;
+
+            reader->batchlen = count;
+            reader->batchpos = 0;
+        }
+
+        struct persist_index_entry_t *entry = &reader->batch[reader->batchpos++];
+
+        /* a reset in the meantime leaves entries that do not fit */
+        if (entry->offset != reader->offset || entry->offset + entry->length > reader->bytes)
+            return -1;
+
+        reader->next++;
+        reader->offset += entry->length;
+        reader->prefix = htonl(entry->length);
+        reader->prefix_left = sizeof(reader->prefix);
+        reader->record_left = reader->data != NULL ? entry->length : 0;
+    }
+
+    return readsum;
+}
+
+
+static int reader_close(void *cookie) {
+    struct persist_reader_t *reader = (struct persist_reader_t *)cookie;
+
+    if (reader->data != NULL)
+        fclose(reader->data);
+
+    free(reader);
+
+    return 0;
+}
+
+
+/*
+ * Open the records of the first `bytes` of the log for reading, each one
+ * as length (u32, network byte order) | record, like binary batches.
+ * The payload is read from `data`, positioned at the start of the log,
+ * which is closed along with the stream. Without `data` only the lengths
+ * are read.
+ * Return the stream or NULL on error, `data` is closed either way.
+ **/
+FILE *persist_fopen_records(struct persist_t *persist, FILE *data, size_t bytes) {
+    struct persist_reader_t *reader = calloc(1, sizeof(struct persist_reader_t));
+
+    if (reader == NULL) {
+        if (data != NULL)
+            fclose(data);
+
+        return NULL;
+    }
+
+    reader->persist = persist;
+    reader->data = data;
+    reader->bytes = bytes;
+
+    cookie_io_functions_t functions = {
+        .read = reader_read,
+        .close = reader_close,
+    };
+
+    FILE *file = fopencookie(reader, "r", functions);
+
+    if (file == NULL)
+        reader_close(reader);
+
+    return file;
+}
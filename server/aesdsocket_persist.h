@@ -0,0 +1,87 @@
+#ifndef AESDSOCKET_PERSIST_H
+#define AESDSOCKET_PERSIST_H
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#include "aesdsocket_datalog.h"
+
+struct coldstore_t;
+
+/*
+ * The data file keeps no framing, its records are listed in sidecar files:
+ *   datafile.idx   one index entry per record, with a running CRC-32 of the
+ *                  log up to the end of the record
+ *   datafile.ckpt  counters of a prefix known to be valid and synced to disk
+ * The index is always kept, it gives binary replays their record boundaries.
+ * A durable index, in persistent mode, is checkpointed and survives restarts.
+ * On startup only index entries after the checkpoint are verified,
+ * the first mismatch marks a torn write and everything after it is dropped.
+ **/
+#define PERSIST_CHECKPOINT_MAGIC 0x41455344
+#define PERSIST_CHECKPOINT_INTERVAL 1024 /* index entries */
+
+struct persist_index_entry_t {
+    uint64_t offset;
+    uint32_t length;
+    uint32_t crc;
+};
+
+struct persist_checkpoint_t {
+    uint32_t magic;
+    uint32_t reserved;
+    uint64_t bytes;
+    uint64_t records;
+    uint64_t entries;
+    uint32_t crc; /* of all fields above */
+} __attribute__((packed));
+
+struct persist_t {
+    char *indexname;
+    char *checkpointname;
+    int datafd;
+    int indexfd;
+    bool durable;  /* checkpointed, see above */
+    uint32_t crc;  /* of the whole log, continued by the next record */
+    size_t entries;
+    size_t checkpoint_entries;
+    size_t checkpoint_bytes; /* cold segments are only cut from this prefix */
+};
+
+uint32_t persist_crc32(uint32_t crc, const void *buffer, size_t buflen);
+
+int persist_open(struct persist_t *persist, const char *datafile, struct coldstore_t *cold, bool durable, struct datalog_pos_t *pos);
+
+void persist_close(struct persist_t *persist, struct datalog_pos_t pos);
+
+int persist_record(struct persist_t *persist, size_t offset, const struct iovec *iov, int iovcnt);
+
+void persist_checkpoint_begin(struct persist_t *persist, struct datalog_pos_t pos, struct persist_checkpoint_t *checkpoint);
+
+int persist_checkpoint_write(struct persist_t *persist, const struct persist_checkpoint_t *checkpoint);
+
+void persist_checkpoint_end(struct persist_t *persist, const struct persist_checkpoint_t *checkpoint);
+
+int persist_checkpoint(struct persist_t *persist, struct datalog_pos_t pos);
+
+int persist_reset(struct persist_t *persist);
+
+void persist_remove(const char *datafile);
+
+int persist_find(struct persist_t *persist, size_t offset, size_t *entry);
+
+int persist_prefix_crc(struct persist_t *persist, size_t entry, uint32_t *crc);
+
+ssize_t persist_read_entries(struct persist_t *persist, size_t first, struct persist_index_entry_t *entries, size_t count);
+
+FILE *persist_fopen_records(struct persist_t *persist, FILE *data, size_t bytes);
+
+#endif//AESDSOCKET_PERSIST_H
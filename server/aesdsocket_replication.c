@@ -0,0 +1,571 @@
+#include "aesdsocket_replication.h"
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <netdb.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#include "aesdsocket_asynclog.h"
+#include "aesdsocket_coldstore.h"
+#include "aesdsocket_net.h"
+#include "aesdsocket_persist.h"
+#include "aesdsocket_threadlist.h"
+
+
+extern volatile bool _doexit;
+extern const char *default_replication_port;
+
+
+#define REPLICATION_CHUNK_SIZE (64 * 1024) /* unless a single record is larger */
+#define REPLICATION_FRAME_RECORDS 1024
+#define REPLICATION_HEARTBEAT_MS 1000
+#define REPLICATION_TIMEOUT_S 5
+#define REPLICATION_LAG_REPORT_MS 5000 /* between lag reports while catching up */
+
+
+/*
+ * Param struct for leader session threads
+ **/
+struct leader_session_t {
+    int socket_id;
+    char *follower_ip;
+    struct datalog_t *datalog;
+};
+
+
+/*
+ * Thread internal dynamic resources that need cleanup on exit.
+ **/
+struct leader_session_res {
+    FILE *socket;
+    FILE *datafile;
+    char *buffer;
+    char *follower_ip;
+};
+
+
+static void destroy_leader_session_res(void *args) {
+    struct leader_session_res *res = (struct leader_session_res *)args;
+
+    if (res->socket) fclose(res->socket);
+    if (res->datafile) fclose(res->datafile);
+    if (res->buffer) free(res->buffer);
+    if (res->follower_ip) free(res->follower_ip);
+}
+
+
+/*
+ * Set send and receive timeouts, so dead peers are noticed eventually.
+ **/
+static void set_socket_timeouts(int sock) {
+    struct timeval timeout = { .tv_sec = REPLICATION_TIMEOUT_S, .tv_usec = 0 };
+    setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    setsockopt(sock, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+}
+
+
+/*
+ * Send the whole buffer, without raising SIGPIPE on closed connections.
+ * Return 0 on success or -1 on error.
+ **/
+static int send_all(int sock, const char *buffer, size_t buflen) {
+    while (buflen > 0) {
+        ssize_t sent = send(sock, buffer, buflen, MSG_NOSIGNAL);
+
+        if (sent < 0) {
+            if (errno == EINTR)
+                continue;
+
+            return -1;
+        }
+
+        buffer += sent;
+        buflen -= sent;
+    }
+
+    return 0;
+}
+
+
+/*
+ * Thread function streaming the log to one follower
+ **/
+static void *leader_session(void *leader_session_args) {
+    struct leader_session_t *args = (struct leader_session_t *)leader_session_args;
+
+    struct leader_session_res res = { 0 };
+    res.follower_ip = args->follower_ip;
+
+    struct datalog_t *datalog = args->datalog;
+    int sock = args->socket_id;
+
+    pthread_cleanup_push(destroy_leader_session_res, &res);
+
+    free(args); args = NULL;
+
+    set_socket_timeouts(sock);
+
+    res.socket = fdopen(sock, "r");
+
+    if (res.socket == NULL) {
+        close(sock);
+        pthread_exit(NULL);
+    }
+
+    size_t buflen = 0;
+    size_t offset;
+    unsigned int follower_crc;
+
+    if (getline(&res.buffer, &buflen, res.socket) <= 0 || sscanf(res.buffer, "FOLLOW %zu %x", &offset, &follower_crc) != 2) {
+        asynclog_write(LOG_ERR, "Invalid replication request from %s", res.follower_ip);
+        pthread_exit(NULL);
+    }
+
+    struct datalog_pos_t pos = datalog_position(datalog);
+    size_t next; /* index entry of the record at offset */
+    uint32_t crc;
+    char header[128];
+
+    /* records are replicated whole, the follower must end where one does, with the same prefix */
+    if (offset > pos.bytes
+        || persist_find(datalog->persist, offset, &next) != 0
+        || persist_prefix_crc(datalog->persist, next, &crc) != 0
+        || crc != follower_crc) {
+        asynclog_write(LOG_ERR, "Follower %s diverged at offset %zu, leader has %zu bytes", res.follower_ip, offset, pos.bytes);
+        int headerlen = snprintf(header, sizeof(header), "DIVERGED %zu\n", pos.bytes);
+        send_all(sock, header, headerlen);
+        pthread_exit(NULL);
+    }
+
+    res.datafile = coldstore_fopen(datalog->cold, datalog->filename);
+
+    if (res.datafile == NULL || fseeko(res.datafile, offset, SEEK_SET) != 0) {
+        asynclog_write(LOG_ERR, "Error opening data file for %s", res.follower_ip);
+        pthread_exit(NULL);
+    }
+
+    size_t bufcap = REPLICATION_CHUNK_SIZE;
+
+    free(res.buffer);
+    res.buffer = malloc(bufcap);
+
+    if (res.buffer == NULL) {
+        pthread_exit(NULL);
+    }
+
+    asynclog_write(LOG_INFO, "Replicating to %s from offset %zu", res.follower_ip, offset);
+
+    struct persist_index_entry_t entries[REPLICATION_FRAME_RECORDS];
+    uint32_t lengths[REPLICATION_FRAME_RECORDS];
+
+    while (!_doexit) {
+        pos = datalog_wait(datalog, offset, REPLICATION_HEARTBEAT_MS);
+
+        ssize_t count = offset < pos.bytes ? persist_read_entries(datalog->persist, next, entries, REPLICATION_FRAME_RECORDS) : 0;
+        size_t chunklen = 0;
+        int nrecords = 0;
+
+        /* whole records up to the counters, at least one even if larger than a chunk */
+        while (nrecords < count
+               && entries[nrecords].offset == offset + chunklen
+               && entries[nrecords].offset + entries[nrecords].length <= pos.bytes
+               && (nrecords == 0 || chunklen + entries[nrecords].length <= REPLICATION_CHUNK_SIZE)) {
+            lengths[nrecords] = htonl(entries[nrecords].length);
+            chunklen += entries[nrecords].length;
+            ++nrecords;
+        }
+
+        /* a reset or torn write, the follower resyncs after reconnecting */
+        if (offset < pos.bytes && nrecords == 0) {
+            asynclog_write(LOG_ERR, "No record indexed at offset %zu for %s", offset, res.follower_ip);
+            break;
+        }
+
+        if (chunklen > bufcap) {
+            char *newbuffer = realloc(res.buffer, chunklen);
+
+            if (newbuffer == NULL)
+                break;
+
+            res.buffer = newbuffer;
+            bufcap = chunklen;
+        }
+
+        if (fread(res.buffer, 1, chunklen, res.datafile) != chunklen) {
+            asynclog_write(LOG_ERR, "Error reading data file for %s at offset %zu", res.follower_ip, offset);
+            break;
+        }
+
+        int headerlen = snprintf(header, sizeof(header), "DATA %zu %d %zu %zu\n", chunklen, nrecords, pos.bytes, pos.records);
+
+        if (send_all(sock, header, headerlen) != 0
+            || send_all(sock, (const char *)lengths, nrecords * sizeof(lengths[0])) != 0
+            || send_all(sock, res.buffer, chunklen) != 0) {
+            asynclog_write(LOG_INFO, "Lost follower %s at offset %zu", res.follower_ip, offset);
+            break;
+        }
+
+        offset += chunklen;
+        next += nrecords;
+    }
+
+    pthread_cleanup_pop(1);
+
+    return NULL;
+}
+
+
+/*
+ * Thread function accepting followers
+ **/
+static void *leader_acceptor(void *replication_leader) {
+    struct replication_leader_t *leader = (struct replication_leader_t *)replication_leader;
+    struct threadlist_node_t *sessions = NULL;
+    struct pollfd pfd = { .fd = leader->socket_id, .events = POLLIN };
+
+    while (!_doexit) {
+        /* poll with timeout to notice server shutdown */
+        if (poll(&pfd, 1, REPLICATION_HEARTBEAT_MS) <= 0)
+            continue;
+
+        struct sockaddr_storage followeraddr;
+        socklen_t followeraddrlen = sizeof(followeraddr);
+
+        int newsock = accept(leader->socket_id, (struct sockaddr *)&followeraddr, &followeraddrlen);
+
+        if (newsock < 0) {
+            asynclog_write(LOG_ERR, "Error accepting follower");
+            continue;
+        }
+
+        struct leader_session_t *session = malloc(sizeof(struct leader_session_t));
+        session->socket_id = newsock;
+        session->follower_ip = get_addr_str((struct sockaddr *)&followeraddr);
+        session->datalog = leader->datalog;
+
+        asynclog_write(LOG_INFO, "Accepted follower %s", session->follower_ip);
+
+        struct threadlist_node_t *newborn = threadlist_node_create();
+
+        if (pthread_create(&newborn->thread_id, NULL, leader_session, session) != 0) {
+            asynclog_write(LOG_ERR, "Error creating replication thread");
+            close(newsock);
+            free(session->follower_ip);
+            free(session);
+            free(newborn);
+            continue;
+        }
+
+        threadlist_attach(&sessions, newborn);
+    }
+
+    threadlist_cleanup(&sessions);
+
+    return NULL;
+}
+
+
+/*
+ * Start accepting followers on the given port.
+ * Return 0 on success or -1 on error.
+ **/
+int replication_leader_start(struct replication_leader_t *leader, const char *port, struct datalog_t *datalog) {
+    leader->datalog = datalog;
+    leader->socket_id = bind_to_port(port);
+
+    if (leader->socket_id < 0) {
+        return -1;
+    }
+
+    if (listen(leader->socket_id, 5) != 0) {
+        asynclog_write(LOG_ERR, "Error listening on replication port %s!", port);
+        close(leader->socket_id);
+        return -1;
+    }
+
+    if (pthread_create(&leader->acceptor_id, NULL, leader_acceptor, leader) != 0) {
+        close(leader->socket_id);
+        return -1;
+    }
+
+    asynclog_write(LOG_INFO, "Replication listening on %s\n", port);
+
+    return 0;
+}
+
+
+/*
+ * Wait for the acceptor and all sessions, call after setting _doexit.
+ **/
+void replication_leader_stop(struct replication_leader_t *leader) {
+    pthread_join(leader->acceptor_id, NULL);
+    close(leader->socket_id);
+}
+
+
+/*
+ * Connect to the leader, return socket or -1 on error.
+ **/
+static int connect_to_leader(const char *host, const char *port) {
+    int result, sock = -1;
+    struct addrinfo hints = {0}, *sockinfo = NULL, *si;
+
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+
+    result = getaddrinfo(host, port, &hints, &sockinfo);
+
+    if (result != 0) {
+        asynclog_write(LOG_ERR, "getaddrinfo: %s\n", gai_strerror(result));
+        return -1;
+    }
+
+    for (si = sockinfo; si != NULL; si = si->ai_next) {
+        sock = socket(si->ai_family, si->ai_socktype, si->ai_protocol);
+
+        if (sock == -1)
+            continue;
+
+        if (connect(sock, si->ai_addr, si->ai_addrlen) == 0)
+            break;
+
+        close(sock);
+        sock = -1;
+    }
+
+    freeaddrinfo(sockinfo);
+
+    return sock;
+}
+
+
+/*
+ * Update and report the replication lag.
+ * Changes are logged right away on heartbeats, which mark the follower as
+ * caught up, and at most every REPLICATION_LAG_REPORT_MS on data frames.
+ **/
+static void update_lag(struct replication_follower_t *follower, size_t leader_bytes, size_t leader_records, bool heartbeat) {
+    struct datalog_pos_t pos = datalog_position(follower->datalog);
+
+    size_t lag_bytes = leader_bytes > pos.bytes ? leader_bytes - pos.bytes : 0;
+    size_t lag_records = leader_records > pos.records ? leader_records - pos.records : 0;
+
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    pthread_mutex_lock(&follower->lock);
+
+    long elapsed_ms = (now.tv_sec - follower->reported.tv_sec) * 1000
+        + (now.tv_nsec - follower->reported.tv_nsec) / 1000000;
+
+    if ((lag_bytes != follower->reported_bytes || lag_records != follower->reported_records)
+        && (heartbeat || elapsed_ms >= REPLICATION_LAG_REPORT_MS)) {
+        asynclog_write(LOG_INFO, "Replication lag %zu bytes, %zu records", lag_bytes, lag_records);
+        follower->reported = now;
+        follower->reported_bytes = lag_bytes;
+        follower->reported_records = lag_records;
+    }
+
+    follower->lag_bytes = lag_bytes;
+    follower->lag_records = lag_records;
+
+    pthread_mutex_unlock(&follower->lock);
+}
+
+
+/*
+ * Follow the leader on a connected socket until error or shutdown.
+ **/
+static void replicate(struct replication_follower_t *follower, FILE *stream) {
+    int sock = fileno(stream);
+    char *header = NULL, *payload = NULL;
+    size_t headerlen = 0, payloadcap = 0;
+    char request[64];
+    uint32_t lengths[REPLICATION_FRAME_RECORDS];
+    struct iovec records[REPLICATION_FRAME_RECORDS];
+
+    struct persist_t *persist = follower->datalog->persist;
+    struct datalog_pos_t pos = datalog_position(follower->datalog);
+    size_t entry;
+    uint32_t crc;
+
+    /* the leader checks our prefix by its CRC, a log it cannot be computed for starts over */
+    if (persist_find(persist, pos.bytes, &entry) != 0 || persist_prefix_crc(persist, entry, &crc) != 0) {
+        asynclog_write(LOG_ERR, "Local log not indexed up to %zu bytes, resetting", pos.bytes);
+
+        if (datalog_reset(follower->datalog) != 0)
+            return;
+
+        pos = (struct datalog_pos_t){ 0 };
+        crc = 0;
+    }
+
+    int requestlen = snprintf(request, sizeof(request), "FOLLOW %zu %08x\n", pos.bytes, crc);
+
+    if (send_all(sock, request, requestlen) != 0) {
+        return;
+    }
+
+    asynclog_write(LOG_INFO, "Following %s:%s from offset %zu", follower->host, follower->port, pos.bytes);
+
+    pthread_mutex_lock(&follower->lock);
+    follower->connected = true;
+    pthread_mutex_unlock(&follower->lock);
+
+    while (!_doexit && getline(&header, &headerlen, stream) > 0) {
+        size_t len, count, leader_bytes, leader_records;
+
+        if (sscanf(header, "DIVERGED %zu", &leader_bytes) == 1) {
+            asynclog_write(LOG_ERR, "Diverged from leader at %zu bytes, resetting local log", leader_bytes);
+            datalog_reset(follower->datalog);
+            break;
+        }
+
+        if (sscanf(header, "DATA %zu %zu %zu %zu", &len, &count, &leader_bytes, &leader_records) != 4
+            || count > REPLICATION_FRAME_RECORDS
+            || fread(lengths, sizeof(lengths[0]), count, stream) != count) {
+            asynclog_write(LOG_ERR, "Invalid replication frame from leader");
+            break;
+        }
+
+        if (len > payloadcap) {
+            char *newpayload = realloc(payload, len);
+
+            if (newpayload == NULL)
+                break;
+
+            payload = newpayload;
+            payloadcap = len;
+        }
+
+        size_t recordsum = 0;
+
+        for (size_t i = 0; i < count; ++i) {
+            records[i].iov_base = payload + recordsum;
+            records[i].iov_len = ntohl(lengths[i]);
+            recordsum += records[i].iov_len;
+        }
+
+        if (recordsum != len) {
+            asynclog_write(LOG_ERR, "Invalid replication frame from leader");
+            break;
+        }
+
+        if (len > 0) {
+            if (fread(payload, 1, len, stream) != len)
+                break;
+
+            /* the local index gets the leader's record boundaries */
+            if (datalog_append_records(follower->datalog, records, count) == -1)
+                break;
+        }
+
+        update_lag(follower, leader_bytes, leader_records, len == 0);
+    }
+
+    pthread_mutex_lock(&follower->lock);
+    follower->connected = false;
+    pthread_mutex_unlock(&follower->lock);
+
+    free(header);
+    free(payload);
+}
+
+
+/*
+ * Thread function keeping the connection to the leader alive
+ **/
+static void *follower_thread(void *replication_follower) {
+    struct replication_follower_t *follower = (struct replication_follower_t *)replication_follower;
+
+    while (!_doexit) {
+        int sock = connect_to_leader(follower->host, follower->port);
+
+        if (sock >= 0) {
+            set_socket_timeouts(sock);
+
+            FILE *stream = fdopen(sock, "r");
+
+            if (stream != NULL) {
+                replicate(follower, stream);
+                fclose(stream);
+            }
+            else {
+                close(sock);
+            }
+
+            asynclog_write(LOG_INFO, "Disconnected from leader %s:%s", follower->host, follower->port);
+        }
+
+        if (!_doexit)
+            sleep(1);
+    }
+
+    return NULL;
+}
+
+
+/*
+ * Start following the leader at `host[:port]`.
+ * Return 0 on success or -1 on error.
+ **/
+int replication_follower_start(struct replication_follower_t *follower, const char *leader_addr, struct datalog_t *datalog) {
+    memset(follower, 0, sizeof(struct replication_follower_t));
+    follower->datalog = datalog;
+
+    const char *sep = strrchr(leader_addr, ':');
+
+    if (sep != NULL) {
+        follower->host = strndup(leader_addr, sep - leader_addr);
+        follower->port = strdup(sep + 1);
+    }
+    else {
+        follower->host = strdup(leader_addr);
+        follower->port = strdup(default_replication_port);
+    }
+
+    pthread_mutex_init(&follower->lock, NULL);
+
+    if (pthread_create(&follower->thread_id, NULL, follower_thread, follower) != 0) {
+        follower->thread_id = 0;
+        replication_follower_stop(follower);
+        return -1;
+    }
+
+    return 0;
+}
+
+
+/*
+ * Format the connection state and lag as `key=value` pairs, for status queries.
+ * Return the length of the string, truncated like snprintf().
+ **/
+int replication_follower_status(struct replication_follower_t *follower, char *buffer, size_t buflen) {
+    pthread_mutex_lock(&follower->lock);
+
+    int len = snprintf(buffer, buflen, "leader=%s:%s connected=%d lag_bytes=%zu lag_records=%zu",
+        follower->host, follower->port, follower->connected, follower->lag_bytes, follower->lag_records);
+
+    pthread_mutex_unlock(&follower->lock);
+
+    return len;
+}
+
+
+/*
+ * Wait for the follower thread and free resources, call after setting _doexit.
+ **/
+void replication_follower_stop(struct replication_follower_t *follower) {
+    if (follower->thread_id)
+        pthread_join(follower->thread_id, NULL);
+
+    pthread_mutex_destroy(&follower->lock);
+    free(follower->host);
+    free(follower->port);
+}
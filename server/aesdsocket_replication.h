@@ -0,0 +1,63 @@
+#ifndef AESDSOCKET_REPLICATION_H
+#define AESDSOCKET_REPLICATION_H
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <time.h>
+
+#include "aesdsocket_datalog.h"
+
+/*
+ * Replication protocol, all headers are newline terminated text:
+ *   follower -> leader: "FOLLOW <offset> <crc>", crc is the CRC-32 of its log
+ *                       up to offset in hex, see persist_prefix_crc()
+ *   leader -> follower: "DATA <len> <count> <leader bytes> <leader records>"
+ *                       + count record lengths (u32, network byte order)
+ *                       + len bytes of records
+ *   leader -> follower: "DIVERGED <leader bytes>" if no leader record ends at
+ *                       offset or the leader log up to there has another CRC
+ * A DATA frame with len 0 is sent as heartbeat when there is nothing to replicate.
+ **/
+
+/*
+ * Leader side: accepts followers and streams appended data to them.
+ **/
+struct replication_leader_t {
+    int socket_id;
+    struct datalog_t *datalog;
+    pthread_t acceptor_id;
+};
+
+/*
+ * Follower side: mirrors the leader log into the local datalog.
+ * Lag values are only valid while holding `lock`.
+ **/
+struct replication_follower_t {
+    char *host;
+    char *port;
+    struct datalog_t *datalog;
+    pthread_t thread_id;
+    pthread_mutex_t lock;
+    bool connected;
+    size_t lag_bytes;
+    size_t lag_records;
+    struct timespec reported; /* last lag report */
+    size_t reported_bytes;
+    size_t reported_records;
+};
+
+int replication_leader_start(struct replication_leader_t *leader, const char *port, struct datalog_t *datalog);
+
+void replication_leader_stop(struct replication_leader_t *leader);
+
+int replication_follower_start(struct replication_follower_t *follower, const char *leader_addr, struct datalog_t *datalog);
+
+int replication_follower_status(struct replication_follower_t *follower, char *buffer, size_t buflen);
+
+void replication_follower_stop(struct replication_follower_t *follower);
+
+#endif//AESDSOCKET_REPLICATION_H
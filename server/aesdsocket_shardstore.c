@@ -0,0 +1,441 @@
+#include "aesdsocket_shardstore.h"
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include "aesdsocket_asynclog.h"
+
+
+/*
+ * Read the existing records of a shard, dropping a torn last record.
+ * Raise `next_seq` above the highest sequence number found.
+ * Return 0 on success or -1 on error.
+ **/
+static int scan_shard(struct shardstore_shard_t *shard, uint64_t *next_seq) {
+    FILE *file = fopen(shard->filename, "r");
+
+    if (file == NULL) {
+        return errno == ENOENT ? 0 : -1;
+    }
+
+    struct shardstore_record_header_t header;
+    char buffer[BUFSIZ];
+
+    while (fread(&header, sizeof(header), 1, file) == 1) {
+        size_t remaining = header.length;
+
+        while (remaining > 0) {
+            size_t readlen = fread(buffer, 1, remaining < sizeof(buffer) ? remaining : sizeof(buffer), file);
+
+            if (readlen == 0)
+                break;
+
+            remaining -= readlen;
+        }
+
+        if (remaining > 0)
+            break;
+
+        shard->filebytes += sizeof(header) + header.length;
+        shard->bytes += header.length;
+        shard->records += 1;
+
+        if (header.seq >= *next_seq)
+            *next_seq = header.seq + 1;
+    }
+
+    fclose(file);
+
+    return truncate(shard->filename, shard->filebytes);
+}
+
+
+/*
+ * Open or create `nshards` shard files named `basename.N`.
+ * With `held` set another process still appends to them, a torn last
+ * record may be in flight, so they are only scanned by shardstore_rescan().
+ * Return 0 on success or -1 on error.
+ **/
+int shardstore_init(struct shardstore_t *store, const char *basename, unsigned nshards, bool held) {
+    if (nshards == 0 || nshards > SHARDSTORE_MAX_SHARDS) {
+        return -1;
+    }
+
+    store->nshards = nshards;
+    store->shards = calloc(nshards, sizeof(struct shardstore_shard_t));
+
+    if (store->shards == NULL) {
+        return -1;
+    }
+
+    uint64_t next_seq = 0;
+    int result = 0;
+
+    for (unsigned i = 0; i < nshards; ++i) {
+        struct shardstore_shard_t *shard = &store->shards[i];
+
+        pthread_mutex_init(&shard->lock, NULL);
+        shard->fd = -1;
+
+        if (asprintf(&shard->filename, "%s.%u", basename, i) < 0) {
+            shard->filename = NULL;
+            result = -1;
+            continue;
+        }
+
+        if (!held && scan_shard(shard, &next_seq) != 0) {
+            result = -1;
+            continue;
+        }
+
+        shard->fd = open(shard->filename, O_WRONLY|O_CREAT|O_APPEND, 0644);
+
+        if (shard->fd < 0)
+            result = -1;
+    }
+
+    atomic_init(&store->next_seq, next_seq);
+
+    if (result != 0) {
+        shardstore_destroy(store);
+    }
+
+    return result;
+}
+
+
+void shardstore_destroy(struct shardstore_t *store) {
+    for (unsigned i = 0; i < store->nshards; ++i) {
+        struct shardstore_shard_t *shard = &store->shards[i];
+
+        if (shard->fd >= 0) close(shard->fd);
+        free(shard->filename);
+        pthread_mutex_destroy(&shard->lock);
+    }
+
+    free(store->shards);
+    store->shards = NULL;
+    store->nshards = 0;
+}
+
+
+/*
+ * Recount all shards after another process appended to them.
+ * Return 0 on success or -1 on error.
+ **/
+int shardstore_rescan(struct shardstore_t *store) {
+    uint64_t next_seq = atomic_load(&store->next_seq);
+    int result = 0;
+
+    for (unsigned i = 0; i < store->nshards; ++i) {
+        struct shardstore_shard_t *shard = &store->shards[i];
+
+        pthread_mutex_lock(&shard->lock);
+
+        shard->filebytes = 0;
+        shard->bytes = 0;
+        shard->records = 0;
+        shard->failed = false; /* the scan cuts off torn records */
+
+        if (scan_shard(shard, &next_seq) != 0)
+            result = -1;
+
+        pthread_mutex_unlock(&shard->lock);
+    }
+
+    atomic_store(&store->next_seq, next_seq);
+
+    return result;
+}
+
+
+/*
+ * Delete all shard files.
+ **/
+void shardstore_remove(struct shardstore_t *store) {
+    for (unsigned i = 0; i < store->nshards; ++i) {
+        if (store->shards[i].filename)
+            unlink(store->shards[i].filename);
+    }
+}
+
+
+/*
+ * Append a record to the shard of the calling cpu.
+ * A short write is cut off again, so the shard always ends in a whole record.
+ * Return number of payload bytes written or -1 on error.
+ **/
+ssize_t shardstore_append(struct shardstore_t *store, const char *buffer, size_t buflen) {
+    if (buflen > UINT32_MAX) {
+        return -1;
+    }
+
+    int cpu = sched_getcpu();
+    struct shardstore_shard_t *shard = &store->shards[(cpu < 0 ? 0 : cpu) % store->nshards];
+
+    struct shardstore_record_header_t header = { .length = buflen };
+    struct iovec iov[2] = {
+        { .iov_base = &header, .iov_len = sizeof(header) },
+        { .iov_base = (void *)buffer, .iov_len = buflen },
+    };
+
+    ssize_t result = -1;
+
+    pthread_mutex_lock(&shard->lock);
+
+    /* stamp under the shard lock, so every shard is sorted by sequence */
+    header.seq = atomic_fetch_add(&store->next_seq, 1);
+
+    /* a failed shard still ends in torn bytes, records behind them would be lost on rescan */
+    ssize_t written = shard->failed ? -1 : writev(shard->fd, iov, 2);
+
+    if (written == (ssize_t)(sizeof(header) + buflen)) {
+        shard->filebytes += sizeof(header) + buflen;
+        shard->bytes += buflen;
+        shard->records += 1;
+        result = buflen;
+    }
+    else if (!shard->failed && ftruncate(shard->fd, shard->filebytes) != 0) {
+        asynclog_write(LOG_ERR, "Error removing torn record from %s, no more appends to it", shard->filename);
+        shard->failed = true;
+    }
+
+    pthread_mutex_unlock(&shard->lock);
+
+    return result;
+}
+
+
+/*
+ * Record the current end of every shard.
+ * All shard locks are held at once, taken in index order, so no append is
+ * halfway done and every sequence number below the cut is included.
+ **/
+void shardstore_snapshot(struct shardstore_t *store, struct shardstore_cut_t *cut) {
+    memset(cut, 0, sizeof(struct shardstore_cut_t));
+
+    for (unsigned i = 0; i < store->nshards; ++i)
+        pthread_mutex_lock(&store->shards[i].lock);
+
+    for (unsigned i = 0; i < store->nshards; ++i) {
+        struct shardstore_shard_t *shard = &store->shards[i];
+
+        cut->filebytes[i] = shard->filebytes;
+        cut->bytes += shard->bytes;
+        cut->records += shard->records;
+    }
+
+    for (unsigned i = store->nshards; i-- > 0; )
+        pthread_mutex_unlock(&store->shards[i].lock);
+}
+
+
+/*
+ * Read position within one shard during a merge
+ **/
+struct merge_cursor_t {
+    FILE *file;
+    size_t remaining; /* bytes left up to the cut */
+    struct shardstore_record_header_t header;
+};
+
+
+/*
+ * State of a stream opened with shardstore_fopen()
+ **/
+struct merge_reader_t {
+    unsigned nshards;
+    struct merge_cursor_t cursors[SHARDSTORE_MAX_SHARDS];
+    struct merge_cursor_t *heap[SHARDSTORE_MAX_SHARDS];
+    unsigned heaplen;
+    size_t record_left; /* payload bytes left of the record at the top of the heap */
+    bool framed;        /* prefix every record with its length */
+    uint32_t prefix;    /* length of the top record in network byte order */
+    size_t prefix_left; /* bytes of `prefix` not yet read */
+};
+
+
+/*
+ * Load the next record header, return false when the shard is exhausted.
+ **/
+static bool merge_cursor_next(struct merge_cursor_t *cursor) {
+    if (cursor->remaining < sizeof(cursor->header))
+        return false;
+
+    if (fread(&cursor->header, sizeof(cursor->header), 1, cursor->file) != 1)
+        return false;
+
+    cursor->remaining -= sizeof(cursor->header);
+
+    return cursor->header.length <= cursor->remaining;
+}
+
+
+/*
+ * Restore the min-heap property below `pos`.
+ **/
+static void merge_heap_sift_down(struct merge_cursor_t **heap, unsigned heaplen, unsigned pos) {
+    for (;;) {
+        unsigned smallest = pos, left = 2 * pos + 1, right = 2 * pos + 2;
+
+        if (left < heaplen && heap[left]->header.seq < heap[smallest]->header.seq)
+            smallest = left;
+
+        if (right < heaplen && heap[right]->header.seq < heap[smallest]->header.seq)
+            smallest = right;
+
+        if (smallest == pos)
+            break;
+
+        struct merge_cursor_t *tmp = heap[pos];
+        heap[pos] = heap[smallest];
+        heap[smallest] = tmp;
+        pos = smallest;
+    }
+}
+
+
+/*
+ * Start reading the record at the top of the heap.
+ **/
+static void merge_reader_top(struct merge_reader_t *reader) {
+    reader->record_left = reader->heaplen > 0 ? reader->heap[0]->header.length : 0;
+
+    if (reader->framed && reader->heaplen > 0) {
+        reader->prefix = htonl(reader->record_left);
+        reader->prefix_left = sizeof(reader->prefix);
+    }
+}
+
+
+/*
+ * Move on to the record with the next sequence number.
+ **/
+static void merge_reader_advance(struct merge_reader_t *reader) {
+    struct merge_cursor_t *cursor = reader->heap[0];
+
+    cursor->remaining -= cursor->header.length;
+
+    if (!merge_cursor_next(cursor))
+        reader->heap[0] = reader->heap[--reader->heaplen];
+
+    merge_heap_sift_down(reader->heap, reader->heaplen, 0);
+    merge_reader_top(reader);
+}
+
+
+static ssize_t merge_reader_read(void *cookie, char *buf, size_t size) {
+    struct merge_reader_t *reader = (struct merge_reader_t *)cookie;
+    size_t readsum = 0;
+
+    while (readsum < size && reader->heaplen > 0) {
+        if (reader->prefix_left > 0) {
+            const char *prefix = (const char *)&reader->prefix + sizeof(reader->prefix) - reader->prefix_left;
+            size_t chunklen = size - readsum < reader->prefix_left ? size - readsum : reader->prefix_left;
+
+            memcpy(buf + readsum, prefix, chunklen);
+            readsum += chunklen;
+            reader->prefix_left -= chunklen;
+            continue;
+        }
+
+        if (reader->record_left == 0) {
+            merge_reader_advance(reader);
+            continue;
+        }
+
+        struct merge_cursor_t *cursor = reader->heap[0];
+        size_t chunklen = size - readsum < reader->record_left ? size - readsum : reader->record_left;
+
+        if (fread(buf + readsum, 1, chunklen, cursor->file) != chunklen)
+            return -1;
+
+        readsum += chunklen;
+        reader->record_left -= chunklen;
+    }
+
+    return readsum;
+}
+
+
+static int merge_reader_close(void *cookie) {
+    struct merge_reader_t *reader = (struct merge_reader_t *)cookie;
+
+    for (unsigned i = 0; i < reader->nshards; ++i) {
+        if (reader->cursors[i].file != NULL)
+            fclose(reader->cursors[i].file);
+    }
+
+    free(reader);
+
+    return 0;
+}
+
+
+/*
+ * Open the payload of all records up to the cut for reading,
+ * in global sequence order, using a k-way merge over the shards.
+ * A NULL cut covers everything appended so far.
+ * With `framed` set every record is preceded by its length as a 32 bit
+ * integer in network byte order, the stream is `bytes + 4 * records` long.
+ * Return the stream or NULL on error.
+ **/
+FILE *shardstore_fopen(struct shardstore_t *store, const struct shardstore_cut_t *cut, bool framed) {
+    struct shardstore_cut_t now;
+
+    if (cut == NULL) {
+        shardstore_snapshot(store, &now);
+        cut = &now;
+    }
+
+    struct merge_reader_t *reader = calloc(1, sizeof(struct merge_reader_t));
+
+    if (reader == NULL)
+        return NULL;
+
+    reader->nshards = store->nshards;
+    reader->framed = framed;
+
+    for (unsigned i = 0; i < store->nshards; ++i) {
+        struct merge_cursor_t *cursor = &reader->cursors[i];
+
+        cursor->remaining = cut->filebytes[i];
+
+        if (cursor->remaining == 0)
+            continue;
+
+        cursor->file = fopen(store->shards[i].filename, "r");
+
+        if (cursor->file == NULL) {
+            merge_reader_close(reader);
+            return NULL;
+        }
+
+        if (merge_cursor_next(cursor))
+            reader->heap[reader->heaplen++] = cursor;
+    }
+
+    for (unsigned i = reader->heaplen; i-- > 0; )
+        merge_heap_sift_down(reader->heap, reader->heaplen, i);
+
+    merge_reader_top(reader);
+
+    cookie_io_functions_t functions = {
+        .read = merge_reader_read,
+        .close = merge_reader_close,
+    };
+
+    FILE *file = fopencookie(reader, "r", functions);
+
+    if (file == NULL)
+        merge_reader_close(reader);
+
+    return file;
+}
@@ -0,0 +1,73 @@
+#ifndef AESDSOCKET_SHARDSTORE_H
+#define AESDSOCKET_SHARDSTORE_H
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <sys/types.h>
+
+#define SHARDSTORE_MAX_SHARDS 64
+
+/*
+ * On-disk record header, followed by `length` payload bytes.
+ * Host byte order, shard files never leave the machine.
+ **/
+struct shardstore_record_header_t {
+    uint64_t seq;
+    uint32_t length;
+} __attribute__((packed));
+
+/*
+ * One append-only shard file, counters only valid while holding `lock`.
+ **/
+struct shardstore_shard_t {
+    pthread_mutex_t lock;
+    char *filename;
+    int fd;
+    size_t filebytes; /* including record headers */
+    size_t bytes;     /* payload only */
+    size_t records;   /* one per append */
+    bool failed;      /* a torn record could not be removed */
+};
+
+/*
+ * Store spreading appends over per-core shards.
+ * Every record is stamped with a global sequence number,
+ * shardstore_fopen() merges the shards back into a single ordered stream.
+ **/
+struct shardstore_t {
+    unsigned nshards;
+    struct shardstore_shard_t *shards;
+    _Atomic uint64_t next_seq;
+};
+
+/*
+ * Consistent cut over all shards, replays stop there.
+ **/
+struct shardstore_cut_t {
+    size_t filebytes[SHARDSTORE_MAX_SHARDS];
+    size_t bytes;
+    size_t records;
+};
+
+int shardstore_init(struct shardstore_t *store, const char *basename, unsigned nshards, bool held);
+
+void shardstore_destroy(struct shardstore_t *store);
+
+int shardstore_rescan(struct shardstore_t *store);
+
+void shardstore_remove(struct shardstore_t *store);
+
+ssize_t shardstore_append(struct shardstore_t *store, const char *buffer, size_t buflen);
+
+void shardstore_snapshot(struct shardstore_t *store, struct shardstore_cut_t *cut);
+
+FILE *shardstore_fopen(struct shardstore_t *store, const struct shardstore_cut_t *cut, bool framed);
+
+#endif//AESDSOCKET_SHARDSTORE_H
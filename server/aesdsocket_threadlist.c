@@ -41,6 +41,36 @@ void threadlist_attach(struct threadlist_node_t **node, struct threadlist_node_t
 }
 
 
+/*
+ * Remove finished threads
+ * Return number of threads still running
+ **/
+size_t threadlist_reap(struct threadlist_node_t **node) {
+    size_t running = 0;
+
+    threadlist_attach(node, NULL);
+
+    for (; *node != NULL; node = &((*node)->next)) {
+        ++running;
+    }
+
+    return running;
+}
+
+
+/*
+ * Cancel all remaining threads
+ * Cleanup the threadlist
+ **/
+void threadlist_cancel(struct threadlist_node_t **head) {
+    for (struct threadlist_node_t *node = *head; node != NULL; node = node->next) {
+        pthread_cancel(node->thread_id);
+    }
+
+    threadlist_cleanup(head);
+}
+
+
 /*
  * Wait for all remaining threads to end
  * Cleanup the threadlist
@@ -6,6 +6,7 @@
 #endif
 
 #include <pthread.h>
+#include <stddef.h>
 
 /*
  * Node struct for thread list
@@ -19,6 +20,10 @@ struct threadlist_node_t * threadlist_node_create();
 
 void threadlist_attach(struct threadlist_node_t **head, struct threadlist_node_t *newborn);
 
+size_t threadlist_reap(struct threadlist_node_t **head);
+
+void threadlist_cancel(struct threadlist_node_t **head);
+
 void threadlist_cleanup(struct threadlist_node_t **head);
 
 #endif//AESDSOCKET_THREADLIST_H
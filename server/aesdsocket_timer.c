@@ -2,39 +2,32 @@
 
 #include <signal.h>
 #include <stdio.h>
-#include <syslog.h>
+#include <string.h>
 
-
-extern char *tmpfilename;
+#include "aesdsocket_asynclog.h"
 
 
 /*
  * Timer thread function to write timestamps
  **/
 static void timer_thread(union sigval sigev_value) {
-    pthread_mutex_t *tmpfile_lock = (pthread_mutex_t *)sigev_value.sival_ptr;
+    struct datalog_t *datalog = (struct datalog_t *)sigev_value.sival_ptr;
 
     char timestamp[64];
     time_t now = time(NULL);
     struct tm *local_now = localtime(&now);
     strftime(timestamp, sizeof(timestamp), "timestamp:%a, %d %b %Y %T %z\n", local_now);
 
-    syslog(LOG_INFO, "Writing %s to tmpfile\n", timestamp);
-
-    pthread_mutex_lock(tmpfile_lock);
-
-    FILE *tmpfile = fopen(tmpfilename, "a");
-    fputs(timestamp, tmpfile);
-    fclose(tmpfile);
+    asynclog_write(LOG_INFO, "Writing %s to tmpfile\n", timestamp);
 
-    pthread_mutex_unlock(tmpfile_lock);
+    datalog_append(datalog, timestamp, strlen(timestamp));
 }
 
 
 /*
  * Create timer that spawns a timestamp writer thread every 10 seconds
  **/
-int create_timestamp_timer(timer_t *timer_id, pthread_mutex_t *tmpfile_lock) {
+int create_timestamp_timer(timer_t *timer_id, struct datalog_t *datalog) {
     struct sigevent sigev = { 0 };
     struct itimerspec timespec = {
         .it_value.tv_sec = 0,
@@ -45,7 +38,7 @@ int create_timestamp_timer(timer_t *timer_id, pthread_mutex_t *tmpfile_lock) {
 
     sigev.sigev_notify = SIGEV_THREAD;
     sigev.sigev_notify_function = &timer_thread;
-    sigev.sigev_value.sival_ptr = tmpfile_lock;
+    sigev.sigev_value.sival_ptr = datalog;
 
     int result = timer_create(CLOCK_REALTIME, &sigev, timer_id);
 
@@ -8,7 +8,9 @@
 #include <pthread.h>
 #include <time.h>
 
-int create_timestamp_timer(timer_t *timer_id, pthread_mutex_t *tmpfile_lock);
+#include "aesdsocket_datalog.h"
+
+int create_timestamp_timer(timer_t *timer_id, struct datalog_t *datalog);
 
 
 #endif//AESDSOCKET_TIMER_H
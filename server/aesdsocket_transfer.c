@@ -0,0 +1,42 @@
+#include "aesdsocket_transfer.h"
+
+#include <stdlib.h>
+
+
+/*
+ * Copy line from instream to outstream.
+ * Return number of bytes copied or -1 on error.
+ **/
+ssize_t transfer_line(FILE *instream, FILE *outstream) {
+    char *buffer = NULL;
+    size_t buflen = 0;
+    ssize_t result;
+
+    result = getline(&buffer, &buflen, instream);
+
+    /* binary payloads may contain NUL bytes, don't use fputs */
+    if (result > 0) {
+        fwrite(buffer, 1, result, outstream);
+        fflush(outstream);
+    }
+
+    free(buffer);
+
+    return result;
+}
+
+
+/*
+ * Copy whole lines from instream to outstream until at least `minlen`
+ * bytes are copied or instream ends.
+ * Return number of bytes copied or -1 on error.
+ **/
+ssize_t transfer_lines(FILE *instream, FILE *outstream, size_t minlen) {
+    size_t transsum = 0;
+    ssize_t transres;
+
+    while (transsum < minlen && (transres = transfer_line(instream, outstream)) > 0)
+        transsum += transres;
+
+    return transsum > 0 || feof(instream) ? (ssize_t)transsum : -1;
+}
@@ -0,0 +1,15 @@
+#ifndef AESDSOCKET_TRANSFER_H
+#define AESDSOCKET_TRANSFER_H
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <stdio.h>
+#include <sys/types.h>
+
+ssize_t transfer_line(FILE *instream, FILE *outstream);
+
+ssize_t transfer_lines(FILE *instream, FILE *outstream, size_t minlen);
+
+#endif//AESDSOCKET_TRANSFER_H
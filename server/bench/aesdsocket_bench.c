@@ -0,0 +1,622 @@
+/*
+ * Micro-benchmarks of the server's hot paths.
+ * Every run first times fixed calibration workloads, one bound by the CPU
+ * and one by syscalls, each result is compared to the baseline relative to
+ * the calibration of its kind, which evens out faster or slower machines.
+ * Ratios still shift between CPU generations, regenerate the baseline with
+ * -u (bench-test.sh -u) when it is used on a new kind of machine.
+ **/
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <limits.h>
+#include <netinet/in.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <syslog.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../aesdsocket_coldstore.h"
+#include "../aesdsocket_datalog.h"
+#include "../aesdsocket_fairshare.h"
+#include "../aesdsocket_net.h"
+#include "../aesdsocket_threadlist.h"
+#include "../aesdsocket_transfer.h"
+
+
+#define BENCH_MAX_CASES 16
+#define BENCH_NAME_SIZE 64
+#define BENCH_LINE_SIZE 64                  /* bytes per record, newline included */
+#define BENCH_TRANSFER_LINES 100000
+#define BENCH_REPLAY_BYTES (16 * 1024 * 1024)
+#define BENCH_THREADS 1000                  /* live threads attached to the list */
+#define BENCH_ADDR_CALLS 1000000
+#define BENCH_APPEND_THREADS 8
+#define BENCH_APPENDS_PER_THREAD 20000
+#define BENCH_CALIBRATE_BYTES (64 * 1024)
+#define BENCH_CALIBRATE_ROUNDS 1024
+#define BENCH_CALIBRATE_SYSCALLS 100000
+#define BENCH_FAIRSHARE_SLOTS 8             /* the server's default */
+
+
+/*
+ * What a benchmark is mostly bound by, selects the calibration it is
+ * compared relative to.
+ **/
+enum bench_kind_t {
+    BENCH_CPU = 0,
+    BENCH_IO = 1,
+    BENCH_KINDS
+};
+
+
+/*
+ * One benchmark, run() does a single repetition and returns its metric,
+ * lower is better.
+ **/
+struct bench_case_t {
+    const char *name;
+    const char *unit;
+    double (*run)(const char *workdir);
+    enum bench_kind_t kind;
+};
+
+
+/*
+ * One metric of a result or baseline file.
+ * `relative` is the value in units of the calibration of its kind, which is
+ * what gets compared, so baselines carry over between machines.
+ **/
+struct bench_result_t {
+    char name[BENCH_NAME_SIZE];
+    double value;
+    double relative;
+};
+
+
+static double now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+
+/*
+ * Write a data file of equally sized records, return 0 on success.
+ **/
+static int make_datafile(const char *path, size_t bytes) {
+    FILE *file = fopen(path, "w");
+
+    if (file == NULL)
+        return -1;
+
+    char line[BENCH_LINE_SIZE];
+    memset(line, 'x', sizeof(line) - 1);
+    line[sizeof(line) - 1] = '\n';
+
+    for (size_t written = 0; written < bytes; written += sizeof(line))
+        fwrite(line, 1, sizeof(line), file);
+
+    return fclose(file);
+}
+
+
+/*
+ * transfer_line() from a data file into /dev/null, ns per line
+ **/
+static double bench_transfer_line(const char *workdir) {
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/transfer", workdir);
+
+    if (make_datafile(path, (size_t)BENCH_TRANSFER_LINES * BENCH_LINE_SIZE) != 0)
+        return -1;
+
+    FILE *instream = fopen(path, "r");
+    FILE *outstream = fopen("/dev/null", "w");
+
+    if (instream == NULL || outstream == NULL)
+        return -1;
+
+    size_t lines = 0;
+    double start = now_ns();
+
+    while (transfer_line(instream, outstream) > 0)
+        lines++;
+
+    double elapsed = now_ns() - start;
+
+    fclose(instream);
+    fclose(outstream);
+    unlink(path);
+
+    return lines == BENCH_TRANSFER_LINES ? elapsed / lines : -1;
+}
+
+
+/*
+ * Thread function discarding everything a client receives
+ **/
+static void *drain_socket(void *args) {
+    int sock = *(int *)args;
+    char buffer[64 * 1024];
+
+    while (read(sock, buffer, sizeof(buffer)) > 0)
+        ;
+
+    return NULL;
+}
+
+
+/*
+ * Replay a full data file to a client the way the connection handler
+ * does, chunk by chunk under fair sharing, ns per MiB
+ **/
+static double bench_replay(const char *workdir) {
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/replay", workdir);
+
+    if (make_datafile(path, BENCH_REPLAY_BYTES) != 0)
+        return -1;
+
+    struct fairshare_t fairshare;
+
+    if (fairshare_init(&fairshare, 0, 0, BENCH_FAIRSHARE_SLOTS) != 0)
+        return -1;
+
+    struct fairshare_client_t *client = fairshare_attach(&fairshare, "127.0.0.1");
+    int sv[2];
+    pthread_t reader_id;
+
+    if (client == NULL || socketpair(AF_UNIX, SOCK_STREAM, 0, sv) != 0)
+        return -1;
+
+    if (pthread_create(&reader_id, NULL, drain_socket, &sv[1]) != 0)
+        return -1;
+
+    FILE *socket = fdopen(sv[0], "a+");
+    setlinebuf(socket);
+
+    double start = now_ns();
+
+    FILE *tmpfile = coldstore_fopen(NULL, path);
+    ssize_t transsum = tmpfile != NULL ? fairshare_replay(client, tmpfile, socket) : -1;
+
+    double elapsed = now_ns() - start;
+
+    if (tmpfile)
+        fclose(tmpfile);
+
+    fclose(socket);
+    pthread_join(reader_id, NULL);
+    close(sv[1]);
+    fairshare_detach(client);
+    fairshare_destroy(&fairshare);
+    unlink(path);
+
+    return transsum == BENCH_REPLAY_BYTES ? elapsed / (BENCH_REPLAY_BYTES / (1024 * 1024)) : -1;
+}
+
+
+static pthread_mutex_t gate = PTHREAD_MUTEX_INITIALIZER;
+
+
+/*
+ * Thread function staying alive until the gate opens
+ **/
+static void *wait_at_gate(void *args) {
+    pthread_mutex_lock(&gate);
+    pthread_mutex_unlock(&gate);
+
+    return NULL;
+}
+
+
+/*
+ * threadlist_attach() with a growing list of live threads, ns per attach
+ **/
+static double bench_threadlist_attach(const char *workdir) {
+    struct threadlist_node_t *children = NULL;
+    pthread_attr_t attr;
+    double elapsed = 0;
+    size_t attached = 0;
+
+    pthread_attr_init(&attr);
+    pthread_attr_setstacksize(&attr, 64 * 1024);
+
+    pthread_mutex_lock(&gate);
+
+    for (int i = 0; i < BENCH_THREADS; i++) {
+        struct threadlist_node_t *newborn = threadlist_node_create();
+
+        if (pthread_create(&newborn->thread_id, &attr, wait_at_gate, NULL) != 0) {
+            free(newborn);
+            break;
+        }
+
+        double start = now_ns();
+        threadlist_attach(&children, newborn);
+        elapsed += now_ns() - start;
+        attached++;
+    }
+
+    pthread_mutex_unlock(&gate);
+    threadlist_cleanup(&children);
+    pthread_attr_destroy(&attr);
+
+    return attached == BENCH_THREADS ? elapsed / attached : -1;
+}
+
+
+/*
+ * get_addr_str() for alternating IPv4 and IPv6 peers, ns per call
+ **/
+static double bench_get_addr_str(const char *workdir) {
+    struct sockaddr_in sin = { .sin_family = AF_INET };
+    struct sockaddr_in6 sin6 = { .sin6_family = AF_INET6 };
+
+    inet_pton(AF_INET, "192.168.100.200", &sin.sin_addr);
+    inet_pton(AF_INET6, "2001:db8:85a3::8a2e:370:7334", &sin6.sin6_addr);
+
+    double start = now_ns();
+
+    for (int i = 0; i < BENCH_ADDR_CALLS; i++) {
+        char *str = get_addr_str(i & 1 ? (struct sockaddr *)&sin6 : (struct sockaddr *)&sin);
+        free(str);
+    }
+
+    return (now_ns() - start) / BENCH_ADDR_CALLS;
+}
+
+
+/*
+ * Thread function appending records as fast as possible
+ **/
+static void *append_records(void *args) {
+    struct datalog_t *datalog = (struct datalog_t *)args;
+
+    char line[BENCH_LINE_SIZE];
+    memset(line, 'y', sizeof(line) - 1);
+    line[sizeof(line) - 1] = '\n';
+
+    for (int i = 0; i < BENCH_APPENDS_PER_THREAD; i++)
+        datalog_append(datalog, line, sizeof(line));
+
+    return NULL;
+}
+
+
+/*
+ * datalog_append() from many threads at once, ns per append
+ **/
+static double bench_append_contended(const char *workdir) {
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/append", workdir);
+
+    struct datalog_t datalog;
+    pthread_t thread_ids[BENCH_APPEND_THREADS];
+
+    unlink(path);
+
+    if (datalog_init(&datalog, path, -1, NULL, NULL, false, false) != 0)
+        return -1;
+
+    double start = now_ns();
+
+    for (int i = 0; i < BENCH_APPEND_THREADS; i++)
+        pthread_create(&thread_ids[i], NULL, append_records, &datalog);
+
+    for (int i = 0; i < BENCH_APPEND_THREADS; i++)
+        pthread_join(thread_ids[i], NULL);
+
+    double elapsed = now_ns() - start;
+
+    size_t records = datalog_position(&datalog).records;
+
+    datalog_destroy(&datalog);
+    unlink(path);
+
+    return records == BENCH_APPEND_THREADS * BENCH_APPENDS_PER_THREAD ? elapsed / records : -1;
+}
+
+
+/*
+ * Fixed integer workload on a cache resident buffer, independent of the
+ * server code, ns per MiB hashed. Measures how fast the CPU is right now,
+ * CPU bound results are stored relative to it.
+ **/
+static double bench_calibrate_cpu(const char *workdir) {
+    static unsigned char buffer[BENCH_CALIBRATE_BYTES];
+    volatile uint32_t sink = 0;
+
+    memset(buffer, 'c', sizeof(buffer));
+
+    double start = now_ns();
+
+    for (int round = 0; round < BENCH_CALIBRATE_ROUNDS; round++) {
+        uint32_t hash = 2166136261u; /* FNV-1a */
+
+        for (size_t i = 0; i < sizeof(buffer); i++)
+            hash = (hash ^ buffer[i]) * 16777619u;
+
+        buffer[round % sizeof(buffer)] = hash;
+        sink ^= hash;
+    }
+
+    double elapsed = now_ns() - start;
+
+    return elapsed / ((double)BENCH_CALIBRATE_ROUNDS * sizeof(buffer) / (1024 * 1024));
+}
+
+
+/*
+ * Fixed syscall workload, small writes and reads on a file and a socket
+ * pair, ns per write and read. Measures how fast the kernel paths are
+ * right now, syscall bound results are stored relative to it.
+ **/
+static double bench_calibrate_io(const char *workdir) {
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/calibrate", workdir);
+
+    char buffer[BENCH_LINE_SIZE];
+    memset(buffer, 'c', sizeof(buffer));
+
+    int fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0600);
+    int sv[2];
+
+    if (fd < 0 || socketpair(AF_UNIX, SOCK_STREAM, 0, sv) != 0)
+        return -1;
+
+    bool complete = true;
+    double start = now_ns();
+
+    for (int i = 0; i < BENCH_CALIBRATE_SYSCALLS && complete; i++) {
+        complete = write(fd, buffer, sizeof(buffer)) == sizeof(buffer)
+            && pread(fd, buffer, sizeof(buffer), (off_t)i * sizeof(buffer)) == sizeof(buffer)
+            && write(sv[0], buffer, sizeof(buffer)) == sizeof(buffer)
+            && read(sv[1], buffer, sizeof(buffer)) == sizeof(buffer);
+    }
+
+    double elapsed = now_ns() - start;
+
+    close(fd);
+    close(sv[0]);
+    close(sv[1]);
+    unlink(path);
+
+    return complete ? elapsed / ((double)BENCH_CALIBRATE_SYSCALLS * 2) : -1;
+}
+
+
+static const char *kind_names[BENCH_KINDS] = { "cpu", "io" };
+
+static const struct bench_case_t calibrations[BENCH_KINDS] = {
+    { "calibrate_cpu", "ns/MiB", bench_calibrate_cpu, BENCH_CPU },
+    { "calibrate_io", "ns/op", bench_calibrate_io, BENCH_IO },
+};
+
+static const struct bench_case_t bench_cases[] = {
+    { "transfer_line", "ns/line", bench_transfer_line, BENCH_IO },
+    { "replay", "ns/MiB", bench_replay, BENCH_IO },
+    { "threadlist_attach", "ns/attach", bench_threadlist_attach, BENCH_CPU },
+    { "get_addr_str", "ns/call", bench_get_addr_str, BENCH_CPU },
+    { "append_contended", "ns/append", bench_append_contended, BENCH_IO },
+};
+
+
+static int compare_double(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+
+/*
+ * Run a case several times, return the median to damp outliers.
+ **/
+static double run_case(const struct bench_case_t *bench, const char *workdir, int repeat) {
+    double values[repeat];
+
+    for (int i = 0; i < repeat; i++) {
+        values[i] = bench->run(workdir);
+
+        if (values[i] < 0)
+            return -1;
+    }
+
+    qsort(values, repeat, sizeof(double), compare_double);
+
+    return values[repeat / 2];
+}
+
+
+/*
+ * Write results as JSON, one metric per line so baselines stay diffable.
+ **/
+static int write_results(const char *path, const double *values, size_t ncases, const double *calibrated) {
+    FILE *file = path ? fopen(path, "w") : stdout;
+
+    if (file == NULL)
+        return -1;
+
+    fprintf(file, "{\n  \"calibration\": {");
+
+    for (int kind = 0; kind < BENCH_KINDS; kind++) {
+        fprintf(file, "\"%s\": {\"unit\": \"%s\", \"value\": %.1f}%s",
+            kind_names[kind], calibrations[kind].unit, calibrated[kind], kind + 1 < BENCH_KINDS ? ", " : "");
+    }
+
+    fprintf(file, "},\n  \"benchmarks\": [\n");
+
+    for (size_t i = 0; i < ncases; i++) {
+        enum bench_kind_t kind = bench_cases[i].kind;
+
+        fprintf(file, "    {\"name\": \"%s\", \"unit\": \"%s\", \"value\": %.1f, \"relative\": %.6g, \"calibration\": \"%s\"}%s\n",
+            bench_cases[i].name, bench_cases[i].unit, values[i], values[i] / calibrated[kind], kind_names[kind], i + 1 < ncases ? "," : "");
+    }
+
+    fprintf(file, "  ]\n}\n");
+
+    return file == stdout ? fflush(file) : fclose(file);
+}
+
+
+/*
+ * Read a file written by write_results(), return number of metrics or -1.
+ **/
+static int read_results(const char *path, struct bench_result_t *results, int maxresults) {
+    FILE *file = fopen(path, "r");
+
+    if (file == NULL)
+        return -1;
+
+    char *line = NULL;
+    size_t linelen = 0;
+    int count = 0;
+
+    while (count < maxresults && getline(&line, &linelen, file) > 0) {
+        if (sscanf(line, " {\"name\": \"%63[^\"]\", \"unit\": \"%*[^\"]\", \"value\": %lf, \"relative\": %lf",
+                results[count].name, &results[count].value, &results[count].relative) == 3)
+            count++;
+    }
+
+    free(line);
+    fclose(file);
+
+    return count;
+}
+
+
+static void usage(const char *name) {
+    fprintf(stderr,
+        "Usage: %s [-b baseline] [-o output] [-t threshold] [-r repeat] [-u]\n"
+        "  -b  baseline to compare against, fail on regressions\n"
+        "  -o  write results to this file, default stdout\n"
+        "  -t  allowed regression in percent, default 30\n"
+        "  -r  repetitions per benchmark, the median counts, default 5\n"
+        "  -u  write results to the baseline instead of comparing\n",
+        name);
+}
+
+
+int main(int argc, char* argv[]) {
+    const char *baseline = NULL;
+    const char *output = NULL;
+    double threshold = 30;
+    int repeat = 5;
+    bool update = false;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "b:o:t:r:u")) != -1) {
+        switch (opt) {
+            case 'b':
+                baseline = optarg;
+                break;
+            case 'o':
+                output = optarg;
+                break;
+            case 't':
+                threshold = strtod(optarg, NULL);
+                break;
+            case 'r':
+                repeat = strtol(optarg, NULL, 10);
+                break;
+            case 'u':
+                update = true;
+                break;
+            default:
+                usage(argv[0]);
+                exit(-1);
+        }
+    }
+
+    if (repeat < 1 || threshold < 0 || (update && baseline == NULL)) {
+        usage(argv[0]);
+        exit(-1);
+    }
+
+    /* keep log noise of the components out of the terminal */
+    openlog("aesdsocket-bench", LOG_PID, LOG_USER);
+    setlogmask(LOG_UPTO(LOG_ERR));
+
+    char workdir[PATH_MAX];
+    const char *tmpdir = getenv("TMPDIR");
+    snprintf(workdir, sizeof(workdir), "%s/aesdsocket-bench-XXXXXX", tmpdir ? tmpdir : "/tmp");
+
+    if (mkdtemp(workdir) == NULL) {
+        perror("mkdtemp");
+        exit(-1);
+    }
+
+    size_t ncases = sizeof(bench_cases) / sizeof(bench_cases[0]);
+    double values[BENCH_MAX_CASES];
+    double calibrated[BENCH_KINDS];
+
+    for (int kind = 0; kind < BENCH_KINDS; kind++) {
+        calibrated[kind] = run_case(&calibrations[kind], workdir, repeat);
+
+        if (calibrated[kind] <= 0) {
+            fprintf(stderr, "Calibration %s failed\n", calibrations[kind].name);
+            rmdir(workdir);
+            exit(-1);
+        }
+    }
+
+    for (size_t i = 0; i < ncases; i++) {
+        values[i] = run_case(&bench_cases[i], workdir, repeat);
+
+        if (values[i] < 0) {
+            fprintf(stderr, "Benchmark %s failed\n", bench_cases[i].name);
+            rmdir(workdir);
+            exit(-1);
+        }
+    }
+
+    rmdir(workdir);
+
+    if (write_results(update ? baseline : output, values, ncases, calibrated) != 0) {
+        perror("write results");
+        exit(-1);
+    }
+
+    if (update || baseline == NULL)
+        exit(0);
+
+    struct bench_result_t expected[BENCH_MAX_CASES];
+    int nexpected = read_results(baseline, expected, BENCH_MAX_CASES);
+
+    /* a missing baseline must not pass as a run without regressions */
+    if (nexpected <= 0) {
+        fprintf(stderr, "No baseline in %s, nothing to compare, record one with -u\n", baseline);
+        exit(1);
+    }
+
+    int regressions = 0;
+
+    for (size_t i = 0; i < ncases; i++) {
+        const char *verdict = "new";
+        double change = 0;
+
+        for (int j = 0; j < nexpected; j++) {
+            if (strcmp(expected[j].name, bench_cases[i].name) || expected[j].relative <= 0)
+                continue;
+
+            change = (values[i] / calibrated[bench_cases[i].kind] / expected[j].relative - 1) * 100;
+            verdict = change > threshold ? "REGRESSED" : "ok";
+            regressions += change > threshold;
+        }
+
+        fprintf(stderr, "%-20s %14.1f %-10s %+7.1f%%  %s\n", bench_cases[i].name, values[i], bench_cases[i].unit, change, verdict);
+    }
+
+    exit(regressions > 0 ? 1 : 0);
+}
@@ -0,0 +1,99 @@
+#!/bin/bash
+# Helpers shared by the aesdsocket behaviour tests, sourced by every test.
+# Servers are started from a scratch directory, all of them are killed
+# and the directory is removed when the test exits.
+# Clients use bash /dev/tcp, so no netcat is needed.
+
+SERVER_DIR=$(cd `dirname ${BASH_SOURCE[0]}`/.. && pwd)
+AESDSOCKET=${SERVER_DIR}/aesdsocket
+WORKDIR=$(mktemp -d /tmp/aesdsocket-test.XXXXXX)
+PIDS=()
+
+cleanup() {
+    for pid in "${PIDS[@]}"; do
+        kill -TERM ${pid} 2>/dev/null
+    done
+    for pid in "${PIDS[@]}"; do
+        wait_for 3 eval "! kill -0 ${pid} 2>/dev/null"
+        { kill -9 ${pid} && wait ${pid}; } 2>/dev/null
+    done
+    rm -rf ${WORKDIR}
+}
+trap cleanup EXIT
+
+fail() {
+    echo "FAIL: $*"
+    exit 1
+}
+
+# wait_port port: wait up to 5 s for a server accepting on port
+wait_port() {
+    for i in $(seq 50); do
+        (exec 3<>/dev/tcp/127.0.0.1/$1) 2>/dev/null && return 0
+        sleep 0.1
+    done
+    return 1
+}
+
+# start_server port [args]: start aesdsocket on port, its pid goes to
+# SERVER_PID and its log to ${WORKDIR}/server-port.log
+start_server() {
+    local port=$1
+    shift
+    ${AESDSOCKET} -p ${port} "$@" 2>>${WORKDIR}/server-${port}.log &
+    SERVER_PID=$!
+    PIDS+=(${SERVER_PID})
+    wait_port ${port} || fail "server on port ${port} did not start"
+}
+
+# stop_server pid: terminate a server and wait for it to exit
+stop_server() {
+    kill -TERM $1 2>/dev/null
+    wait $1 2>/dev/null
+}
+
+# server_log port: the log of the server started on port
+server_log() {
+    cat ${WORKDIR}/server-$1.log
+}
+
+# send_line port line: send one line on a text connection, print the replay
+send_line() {
+    local fd
+    exec {fd}<>/dev/tcp/127.0.0.1/$1 || return 1
+    printf '%s\n' "$2" >&${fd}
+    timeout 10 cat <&${fd}
+    exec {fd}>&-
+}
+
+# send_binary port file: send a binary protocol session, print the responses
+# The session is ended by an oversized frame, answered with TOO_LARGE (02)
+send_binary() {
+    local fd
+    exec {fd}<>/dev/tcp/127.0.0.1/$1 || return 1
+    { printf '\xae'; cat $2; printf 'R\x00\xff\xff\xff\xff'; } >&${fd}
+    timeout 10 cat <&${fd}
+    exec {fd}>&-
+}
+
+# log_bytes port: size of the log of the server on port, from a status query
+log_bytes() {
+    send_line $1 AESDSOCKET_STATUS | sed -n 's/^bytes=\([0-9]*\) .*/\1/p'
+}
+
+# wait_appended port bytes: wait until the log on port grew beyond bytes,
+# e.g. by the timestamp written at startup, so it comes before the test's appends
+wait_appended() {
+    wait_for 5 eval "[ \"\$(log_bytes $1)\" -gt $2 ] 2>/dev/null"
+}
+
+# wait_for seconds command...: retry command every 0.1 s until it succeeds
+wait_for() {
+    local tries=$(($1 * 10))
+    shift
+    for i in $(seq ${tries}); do
+        "$@" && return 0
+        sleep 0.1
+    done
+    return 1
+}
@@ -0,0 +1,98 @@
+#!/bin/bash
+# Binary protocol framing: records with NUL bytes and embedded newlines are
+# stored verbatim and replayed with their own length prefix, in single-file,
+# sharded and compressed mode alike.
+# Every log starts with the timestamp record written at startup.
+source `dirname $0`/common.sh
+
+PORT=9320
+
+# APPEND "a\0b\nc", BATCH "x\n" "yy", BATCH with an empty record, REPLAY
+printf 'A\x00\x00\x00\x00\x05a\x00b\nc' > ${WORKDIR}/session
+printf 'B\x00\x00\x00\x00\x0c\x00\x00\x00\x02x\n\x00\x00\x00\x02yy' >> ${WORKDIR}/session
+printf 'B\x00\x00\x00\x00\x04\x00\x00\x00\x00' >> ${WORKDIR}/session
+printf 'R\x00\x00\x00\x00\x00' >> ${WORKDIR}/session
+printf 'R\x00\x00\x00\x00\x00' > ${WORKDIR}/replay
+
+RECORDS=$(printf '\x00\x00\x00\x05a\x00b\nc\x00\x00\x00\x02x\n\x00\x00\x00\x02yy' | od -An -tx1 | tr -d ' \n')
+
+hex() {
+    od -An -tx1 | tr -d ' \n'
+}
+
+# check_replay response skip: after skip bytes of other responses comes an
+# OK replay of the framed startup timestamp and RECORDS, then TOO_LARGE
+check_replay() {
+    local len=$(($(stat -c %s $1) - $2 - 10))
+    [ "$(tail -c +$(($2 + 1)) $1 | head -c 5 | hex)" == "00$(printf %08x ${len})" ] || return 1
+    [ "$(tail -c +$(($2 + 10)) $1 | head -c 10)" == "timestamp:" ] || return 1
+    [ "$(tail -c 26 $1 | head -c 21 | hex)" == "${RECORDS}" ] || return 1
+    [ "$(tail -c 5 $1 | hex)" == "0200000000" ]
+}
+
+for mode in single sharded; do
+    args="-w ${WORKDIR}/${mode}"
+    [ ${mode} == sharded ] && args="${args} -s 2"
+
+    start_server ${PORT} ${args}
+    wait_appended ${PORT} 0 || fail "no startup timestamp"
+    send_binary ${PORT} ${WORKDIR}/session > ${WORKDIR}/response
+    [ "$(head -c 15 ${WORKDIR}/response | hex)" == "000000000000000000000100000000" ] \
+        || fail "${mode} append: $(od -An -tx1 ${WORKDIR}/response)"
+    check_replay ${WORKDIR}/response 15 || fail "${mode} replay: $(od -An -tx1 ${WORKDIR}/response)"
+    stop_server ${SERVER_PID}
+    PORT=$((PORT + 1))
+done
+
+# records keep their boundaries across restarts, the second startup
+# timestamp is appended behind them
+start_server ${PORT} -P -w ${WORKDIR}/persistent
+wait_appended ${PORT} 0 || fail "no startup timestamp"
+send_binary ${PORT} ${WORKDIR}/session > ${WORKDIR}/before
+stop_server ${SERVER_PID}
+stopped=$(stat -c %s ${WORKDIR}/persistent)
+start_server ${PORT} -P -w ${WORKDIR}/persistent
+wait_appended ${PORT} ${stopped} || fail "no startup timestamp after restart"
+send_binary ${PORT} ${WORKDIR}/replay > ${WORKDIR}/after
+stop_server ${SERVER_PID}
+PORT=$((PORT + 1))
+len=$(($(stat -c %s ${WORKDIR}/before) - 25))
+cmp -s <(tail -c +21 ${WORKDIR}/before | head -c ${len}) <(tail -c +6 ${WORKDIR}/after | head -c ${len}) \
+    || fail "replay after restart lost records: $(od -An -tx1 ${WORKDIR}/after)"
+[ "$(tail -c +$((len + 10)) ${WORKDIR}/after | head -c 10)" == "timestamp:" ] \
+    || fail "replay after restart: $(od -An -tx1 ${WORKDIR}/after)"
+
+# compressed replays carry count and lengths ahead of the gzip stream
+start_server ${PORT} -z -w ${WORKDIR}/compressed
+wait_appended ${PORT} 0 || fail "no startup timestamp"
+send_binary ${PORT} ${WORKDIR}/session > /dev/null
+printf 'R\x02\x00\x00\x00\x00' > ${WORKDIR}/replay
+send_binary ${PORT} ${WORKDIR}/replay > ${WORKDIR}/response
+[ "$(head -c 1 ${WORKDIR}/response | hex)" == "05" ] || fail "no compressed replay: $(od -An -tx1 ${WORKDIR}/response)"
+[ "$(tail -c +6 ${WORKDIR}/response | head -c 4 | hex)" == "00000004" ] || fail "compressed replay record count"
+[ "$(tail -c +14 ${WORKDIR}/response | head -c 12 | hex)" == "000000050000000200000002" ] || fail "compressed replay record lengths"
+tail -c +26 ${WORKDIR}/response | head -c -5 | gunzip > ${WORKDIR}/unpacked || fail "compressed replay is no gzip stream"
+[ "$(tail -c 9 ${WORKDIR}/unpacked | hex)" == "6100620a63780a7979" ] || fail "compressed replay payload differs"
+
+# gzip_replay file: send a compressed replay request, unpack the gzip stream into file
+gzip_replay() {
+    send_binary ${PORT} ${WORKDIR}/replay > ${WORKDIR}/response
+    local count=$((16#$(tail -c +6 ${WORKDIR}/response | head -c 4 | hex)))
+    tail -c +$((10 + 4 * count)) ${WORKDIR}/response | head -c -5 | gunzip > $1
+}
+
+# stored segments come first, later replays extend the tail of earlier ones
+yes $(printf 'z%.0s' $(seq 63)) | head -n $((3 * 1024 * 1024 / 64)) > ${WORKDIR}/lines
+{ printf 'A\x00\x00\x30\x00\x00'; cat ${WORKDIR}/lines; } > ${WORKDIR}/fill
+send_binary ${PORT} ${WORKDIR}/fill > /dev/null
+wait_for 5 eval "[ \$(stat -c %s ${WORKDIR}/compressed.cold) -gt 0 ]" || fail "no cold segments"
+for i in 1 2 3; do
+    send_line ${PORT} "tail line ${i}" > ${WORKDIR}/plain
+    gzip_replay ${WORKDIR}/unpacked || fail "compressed replay ${i} is no gzip stream"
+    # a timestamp may have come in between
+    cmp -s ${WORKDIR}/plain <(head -c $(stat -c %s ${WORKDIR}/plain) ${WORKDIR}/unpacked) \
+        || fail "compressed replay ${i} differs from the plain one"
+done
+grep -c "z\{63\}$" ${WORKDIR}/plain | grep -q "^$((3 * 1024 * 1024 / 64))$" || fail "cold segments replayed wrong"
+
+echo "PASS: binproto"
@@ -0,0 +1,41 @@
+#!/bin/bash
+# Fair sharing: a client that stops reading its replay does not hold the
+# only slot, and replays are throttled to the configured rate.
+source `dirname $0`/common.sh
+
+PORT=9380
+
+# fill port mib: append mib MiB of 64 byte lines in 1 MiB records
+fill() {
+    yes $(printf 'x%.0s' $(seq 63)) | head -n $((1024 * 1024 / 64)) > ${WORKDIR}/record
+    for i in $(seq $2); do
+        printf 'A\x00\x00\x10\x00\x00'
+        cat ${WORKDIR}/record
+    done > ${WORKDIR}/fill
+    send_binary $1 ${WORKDIR}/fill > /dev/null
+    wait_for 5 eval "[ \$(log_bytes $1) -ge $(($2 * 1024 * 1024)) ]" || fail "log not filled"
+}
+
+# a stalled replay leaves the single slot to the others
+start_server ${PORT} -w ${WORKDIR}/stalled -c 1
+fill ${PORT} 16
+exec {STALLED}<>/dev/tcp/127.0.0.1/${PORT} || fail "could not connect"
+printf 'stalled\n' >&${STALLED}
+sleep 1
+send_line ${PORT} "served" > ${WORKDIR}/replay
+[ "$(tail -n 1 ${WORKDIR}/replay)" == "served" ] || fail "client starved behind a stalled replay"
+exec {STALLED}>&-
+stop_server ${SERVER_PID}
+PORT=$((PORT + 1))
+
+# replays of a client are throttled to 1 MiB/s
+start_server ${PORT} -w ${WORKDIR}/throttled -R $((1024 * 1024)) -v 7
+fill ${PORT} 4
+start=$(date +%s%N)
+send_line ${PORT} "throttled" > ${WORKDIR}/replay
+elapsed_ms=$((($(date +%s%N) - start) / 1000000))
+[ "$(tail -n 1 ${WORKDIR}/replay)" == "throttled" ] || fail "throttled replay incomplete"
+[ ${elapsed_ms} -ge 2500 ] || fail "4 MiB replayed in ${elapsed_ms} ms at 1 MiB/s"
+wait_for 5 eval "server_log ${PORT} | grep -q 'Throttled 0 appends and [1-9][0-9]* replays of 127.0.0.1'" || fail "throttling not counted"
+
+echo "PASS: fairshare"
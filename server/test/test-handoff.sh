@@ -0,0 +1,59 @@
+#!/bin/bash
+# Hot restart: a successor takes over the listening socket, connections
+# keep being accepted throughout, the predecessor stops accepting, finishes
+# its open connection and the successor appends behind it.
+source `dirname $0`/common.sh
+
+PORT=9370
+HANDOFF=${WORKDIR}/handoff.sock
+DATAFILE=${WORKDIR}/handoff
+
+start_server ${PORT} -w ${DATAFILE} -u ${HANDOFF}
+PREDECESSOR_PID=${SERVER_PID}
+wait_appended ${PORT} 0 || fail "no startup timestamp"
+send_line ${PORT} "before handoff" > /dev/null
+
+# a connection in flight, its packet is only finished after the handoff
+exec {INFLIGHT}<>/dev/tcp/127.0.0.1/${PORT} || fail "could not connect"
+printf 'in flight' >&${INFLIGHT}
+
+# clients connecting all through the upgrade
+clients() {
+    for i in $(seq 30); do
+        send_line ${PORT} "client ${i}" > /dev/null || echo "refused ${i}"
+        sleep 0.05
+    done > ${WORKDIR}/refused
+}
+clients &
+CLIENTS_PID=$!
+
+${AESDSOCKET} -p ${PORT} -w ${DATAFILE} -u ${HANDOFF} 2>>${WORKDIR}/successor.log &
+SUCCESSOR_PID=$!
+PIDS+=(${SUCCESSOR_PID})
+
+wait_for 5 eval "server_log ${PORT} | grep -q 'Handed off to successor'" || fail "predecessor did not hand off"
+grep -q "Took over 2 descriptors" ${WORKDIR}/successor.log || fail "successor did not take over"
+
+# the predecessor stops accepting right away, the successor serves everyone
+handed_off=$(server_log ${PORT} | grep -n "Handed off" | cut -d: -f1)
+server_log ${PORT} | tail -n +${handed_off} | grep -q "Accepted connection" && fail "predecessor accepted after the handoff"
+
+printf ' line\n' >&${INFLIGHT}
+timeout 5 cat <&${INFLIGHT} | grep -q "^in flight line$" || fail "in-flight connection not finished"
+exec {INFLIGHT}>&-
+
+wait ${CLIENTS_PID}
+[ -s ${WORKDIR}/refused ] && fail "connections refused during the upgrade: $(cat ${WORKDIR}/refused)"
+
+wait_for 10 eval "! kill -0 ${PREDECESSOR_PID} 2>/dev/null" || fail "predecessor did not exit"
+wait_for 5 grep -q "Handoff complete, appends released" ${WORKDIR}/successor.log || fail "appends not released"
+
+# the successor appends behind everything the predecessor wrote
+send_line ${PORT} "after handoff" > ${WORKDIR}/replay
+[ "$(tail -n 1 ${WORKDIR}/replay)" == "after handoff" ] || fail "append after the handoff missing"
+for line in "before handoff" "in flight line" "client 30"; do
+    grep -q "^${line}$" ${WORKDIR}/replay || fail "'${line}' lost in the handoff"
+done
+[ $(grep -c "^client [0-9]*$" ${DATAFILE}) -eq 30 ] || fail "client appends lost in the handoff"
+
+echo "PASS: handoff"
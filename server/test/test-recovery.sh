@@ -0,0 +1,82 @@
+#!/bin/bash
+# Persistent mode: a killed server comes back with every acknowledged
+# append, torn or corrupted records at the end of the data file are
+# dropped and appends go on right behind the valid prefix.
+# Every start appends a timestamp record.
+source `dirname $0`/common.sh
+
+PORT=9360
+DATAFILE=${WORKDIR}/persistent
+
+# start_persistent: start the server on the data file and wait for its
+# startup timestamp behind the recovered log
+start_persistent() {
+    local recoveries=$(server_log ${PORT} 2>/dev/null | grep -c Recovered)
+    start_server ${PORT} -P -w ${DATAFILE}
+    wait_for 5 eval "[ \$(server_log ${PORT} | grep -c Recovered) -gt ${recoveries} ]" || fail "no recovery"
+    local recovered=$(server_log ${PORT} | grep Recovered | tail -n 1 | sed 's/.*(\([0-9]*\) bytes).*/\1/')
+    wait_appended ${PORT} ${recovered} || fail "no startup timestamp"
+}
+
+start_persistent
+for i in 1 2 3; do
+    send_line ${PORT} "line ${i}" > /dev/null
+done
+stop_server ${SERVER_PID}
+
+# a clean shutdown leaves a checkpoint, nothing is left to verify
+start_persistent
+wait_for 5 eval "server_log ${PORT} | grep -q 'Recovered 4 records .* verified 0 records after checkpoint'" \
+    || fail "no checkpoint after a clean shutdown: $(server_log ${PORT})"
+
+# records appended after the checkpoint survive a crash
+send_line ${PORT} "line 4" > /dev/null
+kill -9 ${SERVER_PID}
+wait ${SERVER_PID} 2>/dev/null
+cp ${DATAFILE} ${WORKDIR}/before-crash
+
+start_persistent
+wait_for 5 eval "server_log ${PORT} | grep -q 'Recovered 6 records .* verified 2 records after checkpoint'" \
+    || fail "appends after the checkpoint lost: $(server_log ${PORT})"
+cmp -s <(send_line ${PORT} "line 5" | head -c $(stat -c %s ${WORKDIR}/before-crash)) ${WORKDIR}/before-crash \
+    || fail "replay after a crash differs"
+kill -9 ${SERVER_PID}
+wait ${SERVER_PID} 2>/dev/null
+
+# a torn write at the end of the file is dropped
+cp ${DATAFILE} ${WORKDIR}/before-tear
+printf 'torn rec' >> ${DATAFILE}
+start_persistent
+wait_for 5 eval "server_log ${PORT} | grep -q 'Dropped 8 bytes of torn or unindexed writes'" || fail "torn write kept: $(server_log ${PORT})"
+send_line ${PORT} "line 6" > ${WORKDIR}/replay
+grep -q "torn rec" ${WORKDIR}/replay && fail "torn write replayed"
+cmp -s <(head -c $(stat -c %s ${WORKDIR}/before-tear) ${WORKDIR}/replay) ${WORKDIR}/before-tear \
+    || fail "valid prefix changed by recovery"
+tail -n 1 ${WORKDIR}/replay | grep -q "^line 6$" || fail "append after recovery not behind the valid prefix"
+kill -9 ${SERVER_PID}
+wait ${SERVER_PID} 2>/dev/null
+
+# a corrupted record after the checkpoint is dropped with everything behind it
+sed -i 's/^line 5$/lime 5/' ${DATAFILE}
+start_persistent
+send_line ${PORT} "line 7" > ${WORKDIR}/replay
+grep -q "line 5\|lime 5\|line 6" ${WORKDIR}/replay && fail "corrupted record or records behind it replayed"
+grep -q "line 4" ${WORKDIR}/replay || fail "records before the corruption lost"
+tail -n 1 ${WORKDIR}/replay | grep -q "^line 7$" || fail "append after recovery from corruption lost"
+
+# checkpoints are also taken while running, recovery after a crash only
+# verifies the records since the last one
+for i in $(seq 1100); do
+    printf '\x00\x00\x00\x02r\n'
+done > ${WORKDIR}/records
+{ printf 'B\x00\x00\x00\x19\xc8'; cat ${WORKDIR}/records; } > ${WORKDIR}/batch
+cp ${DATAFILE}.ckpt ${WORKDIR}/checkpoint
+send_binary ${PORT} ${WORKDIR}/batch > /dev/null
+wait_for 5 eval "! cmp -s ${DATAFILE}.ckpt ${WORKDIR}/checkpoint" || fail "no checkpoint while running"
+kill -9 ${SERVER_PID}
+wait ${SERVER_PID} 2>/dev/null
+start_persistent
+wait_for 5 eval "server_log ${PORT} | grep -q 'Recovered 11[0-9][0-9] records .* verified [0-9]\{1,2\} records after checkpoint'" \
+    || fail "running checkpoint not used: $(server_log ${PORT} | grep Recovered)"
+
+echo "PASS: recovery"
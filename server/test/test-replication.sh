@@ -0,0 +1,50 @@
+#!/bin/bash
+# Leader and follower on localhost: appends to the leader show up in the
+# follower's own data file and in its replays, a follower that diverged
+# from its leader starts over.
+source `dirname $0`/common.sh
+
+LEADER_PORT=9310
+FOLLOWER_PORT=9311
+REPLICATION_PORT=9312
+
+start_server ${LEADER_PORT} -w ${WORKDIR}/leader -r ${REPLICATION_PORT}
+LEADER_PID=${SERVER_PID}
+start_server ${FOLLOWER_PORT} -P -w ${WORKDIR}/follower -f 127.0.0.1:${REPLICATION_PORT}
+FOLLOWER_PID=${SERVER_PID}
+
+for i in 1 2 3; do
+    send_line ${LEADER_PORT} "replicated line ${i}" > /dev/null
+done
+
+wait_for 5 cmp -s ${WORKDIR}/leader ${WORKDIR}/follower || fail "follower data file differs from the leader's"
+grep -q "replicated line 3" ${WORKDIR}/follower || fail "follower data file misses appends"
+
+# followers are read-only, the packet is discarded and the local copy replayed
+send_line ${FOLLOWER_PORT} "ignored" > ${WORKDIR}/replay
+cmp -s ${WORKDIR}/leader ${WORKDIR}/replay || fail "follower replay differs from the leader's data file"
+grep -q ignored ${WORKDIR}/follower && fail "follower accepted an append"
+
+# the status line reports the lag once the leader's heartbeat arrived
+caught_up() {
+    send_line ${FOLLOWER_PORT} AESDSOCKET_STATUS > ${WORKDIR}/status
+    grep -q "^bytes=$(stat -c %s ${WORKDIR}/leader) records=4 leader=127.0.0.1:${REPLICATION_PORT} connected=1 lag_bytes=0 lag_records=0$" ${WORKDIR}/status
+}
+wait_for 5 caught_up || fail "follower status: $(cat ${WORKDIR}/status)"
+send_line ${LEADER_PORT} AESDSOCKET_STATUS | grep -q "^bytes=[0-9]* records=4$" || fail "leader status"
+
+# the default data file is the leader's, a follower must bring its own
+timeout 2 ${AESDSOCKET} -p 9313 -f 127.0.0.1:${REPLICATION_PORT} 2>/dev/null
+[ $? -eq 255 ] || fail "follower started without -w"
+
+# a new leader with the same record lengths but other contents
+stop_server ${FOLLOWER_PID}
+sed '1s/^t/T/' ${WORKDIR}/leader > ${WORKDIR}/other-leader
+stop_server ${LEADER_PID}
+start_server ${LEADER_PORT} -w ${WORKDIR}/other-leader -r ${REPLICATION_PORT}
+start_server ${FOLLOWER_PORT} -P -w ${WORKDIR}/follower -f 127.0.0.1:${REPLICATION_PORT}
+
+wait_for 5 cmp -s ${WORKDIR}/other-leader ${WORKDIR}/follower || fail "diverged follower did not start over"
+server_log ${FOLLOWER_PORT} | grep -q "Diverged from leader" || fail "divergence went unnoticed"
+
+echo "PASS: replication"
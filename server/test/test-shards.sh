@@ -0,0 +1,36 @@
+#!/bin/bash
+# Sharded storage: appends from concurrent clients spread over the shards
+# and come back from the merged replay in the order they were made.
+source `dirname $0`/common.sh
+
+PORT=9350
+WRITERS=4
+LINES=50
+
+start_server ${PORT} -w ${WORKDIR}/sharded -s ${WRITERS}
+wait_appended ${PORT} 0 || fail "no startup timestamp"
+
+# every writer appends its lines one after the other, in parallel to the others
+for writer in $(seq ${WRITERS}); do
+    (
+        for line in $(seq ${LINES}); do
+            send_line ${PORT} "writer ${writer} line ${line}" > /dev/null
+        done
+    ) &
+done
+wait $(jobs -p | grep -v ${SERVER_PID})
+
+send_line ${PORT} "last line" > ${WORKDIR}/replay
+
+[ $(grep -c "^writer" ${WORKDIR}/replay) -eq $((WRITERS * LINES)) ] || fail "replay misses appends"
+tail -n 1 ${WORKDIR}/replay | grep -q "^last line$" || fail "last append not at the end of the replay"
+
+for writer in $(seq ${WRITERS}); do
+    grep "^writer ${writer} " ${WORKDIR}/replay | cut -d' ' -f4 > ${WORKDIR}/order
+    seq ${LINES} | cmp -s - ${WORKDIR}/order || fail "appends of writer ${writer} out of order"
+done
+
+# the startup timestamp was the first append of all
+head -n 1 ${WORKDIR}/replay | grep -q "^timestamp:" || fail "replay does not start with the first append"
+
+echo "PASS: shards"
@@ -0,0 +1,63 @@
+#!/bin/bash
+# Subscriptions: every subscriber receives new appends, one that does not
+# read is evicted under the disconnect policy and skips ahead under the
+# drop policy, without holding up the others.
+source `dirname $0`/common.sh
+
+PORT=9340
+
+# subscribe port: open a subscription, its descriptor goes to SUBSCRIBER
+subscribe() {
+    exec {SUBSCRIBER}<>/dev/tcp/127.0.0.1/$1 || fail "could not subscribe"
+    printf 'AESDSOCKET_SUBSCRIBE\n' >&${SUBSCRIBER}
+    wait_for 5 eval "server_log $1 | grep -q Subscribed" || fail "subscription not set up"
+}
+
+# flood port: append 16 MiB, more than the ring and the socket buffers hold
+flood() {
+    head -c $((1024 * 1024)) /dev/zero | tr '\0' 'x' > ${WORKDIR}/record
+    for i in $(seq 16); do
+        printf 'A\x00\x00\x10\x00\x00'
+        cat ${WORKDIR}/record
+    done > ${WORKDIR}/flood
+    send_binary $1 ${WORKDIR}/flood > /dev/null
+}
+
+# fan-out to two subscribers
+start_server ${PORT} -w ${WORKDIR}/fanout -v 7
+subscribe ${PORT}
+timeout 10 cat <&${SUBSCRIBER} > ${WORKDIR}/first &
+exec {SUBSCRIBER}>&-
+subscribe ${PORT}
+timeout 10 cat <&${SUBSCRIBER} > ${WORKDIR}/second &
+exec {SUBSCRIBER}>&-
+wait_for 5 eval "[ \$(server_log ${PORT} | grep -c Subscribed) -eq 2 ]" || fail "second subscription not set up"
+
+send_line ${PORT} "broadcast line" > /dev/null
+wait_for 5 grep -q "broadcast line" ${WORKDIR}/first || fail "first subscriber missed the append"
+wait_for 5 grep -q "broadcast line" ${WORKDIR}/second || fail "second subscriber missed the append"
+stop_server ${SERVER_PID}
+PORT=$((PORT + 1))
+
+# a subscriber that stopped reading is disconnected once the ring laps it
+start_server ${PORT} -w ${WORKDIR}/disconnect -v 7 -l disconnect
+subscribe ${PORT}
+flood ${PORT}
+wait_for 10 eval "server_log ${PORT} | grep -q 'lagged behind, disconnecting'" || fail "stalled subscriber not evicted"
+timeout 10 cat <&${SUBSCRIBER} > /dev/null || fail "evicted subscriber still connected"
+exec {SUBSCRIBER}>&-
+send_line ${PORT} "still serving" | grep -q "still serving" || fail "server stuck after eviction"
+stop_server ${SERVER_PID}
+PORT=$((PORT + 1))
+
+# under the drop policy it skips what the ring lost and stays subscribed
+start_server ${PORT} -w ${WORKDIR}/drop -v 7 -l drop
+subscribe ${PORT}
+flood ${PORT}
+timeout 30 cat <&${SUBSCRIBER} > ${WORKDIR}/dropped &
+wait_for 10 eval "server_log ${PORT} | grep -q 'lagged behind, dropped'" || fail "stalled subscriber did not skip ahead"
+send_line ${PORT} "after the gap" > /dev/null
+wait_for 10 grep -q "after the gap" ${WORKDIR}/dropped || fail "subscriber lost after dropping"
+exec {SUBSCRIBER}>&-
+
+echo "PASS: subscribe"